@@ -0,0 +1,561 @@
+#define _GNU_SOURCE   // for O_DIRECT and fallocate
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+
+/*******
+ * Disk backends: each one implements the struct disk_backend operations
+ * for one way of keeping the device blocks. disk.c does the range checks,
+ * statistics and locking, so these functions only move the data;
+ * transfers return 0 if ok, or -1 (with errno set) if the host I/O failed.
+ */
+
+#define SG_MAX 64   // iovecs per preadv/pwritev call
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+/** opens filename as a disk image with the given extra open flags;
+ *  if it does not exist and *n > 0 creates it with *n blocks;
+ *  sets *n to the image size in blocks; returns the file descriptor or -1
+ */
+static int image_open(const char *filename, int *n, int flags) {
+    int fd = open(filename, O_RDWR | flags);
+    if (fd >= 0) {
+        int size = lseek(fd, 0, SEEK_END);   // ignore provided n
+        fprintf(stderr, "Disk image size=%d, %d blocks\n", size, size / DISK_BLOCK_SIZE);
+        *n = size / DISK_BLOCK_SIZE;
+    }
+    if (fd < 0 && *n > 0)
+        fd = open(filename, O_RDWR | O_CREAT | flags, 0666);
+    if (fd < 0)
+        return -1;
+
+    ftruncate(fd, (off_t)*n * DISK_BLOCK_SIZE); // new space is a hole: images start sparse
+    return fd;
+}
+
+/** frees the host storage of count blocks from start in the image file fd,
+ *  leaving a hole that reads as zeros; returns 0 if ok, -1 if not supported
+ */
+static int punch_hole(int fd, unsigned start, unsigned count) {
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t)start * DISK_BLOCK_SIZE, (off_t)count * DISK_BLOCK_SIZE);
+}
+
+/*****************************************************/
+
+/* stdio: buffered FILE access to the image (the original device) */
+
+static FILE *diskfile;
+static unsigned stdio_blocks;
+
+static int stdio_init(const char *filename, int n) {
+    int fd = image_open(filename, &n, 0);
+    if (fd < 0)
+        return -1;
+    diskfile = fdopen(fd, "r+");
+    if (diskfile == NULL) {
+        close(fd);
+        return -1;
+    }
+    stdio_blocks = n;
+    return n;
+}
+
+static int stdio_read(unsigned start, unsigned count, char *data) {
+    fseek(diskfile, (off_t)start * DISK_BLOCK_SIZE, SEEK_SET);
+    return fread(data, DISK_BLOCK_SIZE, count, diskfile) == count ? 0 : -1;
+}
+
+static int stdio_write(unsigned start, unsigned count, const char *data) {
+    fseek(diskfile, (off_t)start * DISK_BLOCK_SIZE, SEEK_SET);
+    return fwrite(data, DISK_BLOCK_SIZE, count, diskfile) == count ? 0 : -1;
+}
+
+static int stdio_read_sg(unsigned start, unsigned count, char *bufs[]) {
+    fseek(diskfile, (off_t)start * DISK_BLOCK_SIZE, SEEK_SET);
+    for (unsigned i = 0; i < count; i++)
+        if (fread(bufs[i], DISK_BLOCK_SIZE, 1, diskfile) != 1)
+            return -1;
+    return 0;
+}
+
+static int stdio_write_sg(unsigned start, unsigned count, char *const bufs[]) {
+    fseek(diskfile, (off_t)start * DISK_BLOCK_SIZE, SEEK_SET);
+    for (unsigned i = 0; i < count; i++)
+        if (fwrite(bufs[i], DISK_BLOCK_SIZE, 1, diskfile) != 1)
+            return -1;
+    return 0;
+}
+
+static int stdio_discard(unsigned start, unsigned count) {
+    fflush(diskfile); // nothing buffered may land on the hole later
+    return punch_hole(fileno(diskfile), start, count);
+}
+
+static unsigned stdio_size() {
+    return stdio_blocks;
+}
+
+static void stdio_close() {
+    fclose(diskfile);
+    diskfile = NULL;
+}
+
+const struct disk_backend disk_stdio = {
+    .name = "stdio",
+    .init = stdio_init,
+    .read = stdio_read,
+    .write = stdio_write,
+    .read_sg = stdio_read_sg,
+    .write_sg = stdio_write_sg,
+    .discard = stdio_discard,
+    .size = stdio_size,
+    .close = stdio_close,
+    .parallel = 0   // shares the FILE position
+};
+
+/*****************************************************/
+
+/* mmap: the image file is mapped in memory; blocks can be used in place */
+
+static char *diskmap;
+static int mapfd = -1;   // kept open to punch holes
+static unsigned mmap_blocks;
+
+static int mmap_init(const char *filename, int n) {
+    int fd = image_open(filename, &n, 0);
+    if (fd < 0)
+        return -1;
+    diskmap = NULL;
+    if (n > 0) {
+        diskmap = mmap(NULL, (size_t)n * DISK_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (diskmap == MAP_FAILED) {
+            diskmap = NULL;
+            close(fd);
+            return -1;
+        }
+    }
+    mapfd = fd;
+    mmap_blocks = n;
+    return n;
+}
+
+static int mmap_read(unsigned start, unsigned count, char *data) {
+    memcpy(data, diskmap + (size_t)start * DISK_BLOCK_SIZE, (size_t)count * DISK_BLOCK_SIZE);
+    return 0;
+}
+
+static int mmap_write(unsigned start, unsigned count, const char *data) {
+    memcpy(diskmap + (size_t)start * DISK_BLOCK_SIZE, data, (size_t)count * DISK_BLOCK_SIZE);
+    return 0;
+}
+
+static char *mmap_block_ptr(unsigned blocknum) {
+    return diskmap + (size_t)blocknum * DISK_BLOCK_SIZE;
+}
+
+static int mmap_discard(unsigned start, unsigned count) {
+    return punch_hole(mapfd, start, count);  // the mapping also sees the hole
+}
+
+static unsigned mmap_size() {
+    return mmap_blocks;
+}
+
+static void mmap_close() {
+    if (diskmap) {
+        msync(diskmap, (size_t)mmap_blocks * DISK_BLOCK_SIZE, MS_SYNC);
+        munmap(diskmap, (size_t)mmap_blocks * DISK_BLOCK_SIZE);
+        diskmap = NULL;
+    }
+    close(mapfd);
+    mapfd = -1;
+}
+
+const struct disk_backend disk_mmap = {
+    .name = "mmap",
+    .init = mmap_init,
+    .read = mmap_read,
+    .write = mmap_write,
+    .block_ptr = mmap_block_ptr,
+    .discard = mmap_discard,
+    .size = mmap_size,
+    .close = mmap_close,
+    .parallel = 1
+};
+
+/*****************************************************/
+
+/* pread and direct: positional I/O on a file descriptor; direct opens it
+ * with O_DIRECT (bypassing the host page cache) and moves the data through
+ * an aligned buffer
+ */
+
+#define DIRECT_ALIGN 4096  // buffer alignment that satisfies O_DIRECT on common devices
+#define BOUNCE_BLOCKS 64   // blocks moved per host I/O through the O_DIRECT buffer
+#define BOUNCE_SIZE   ((size_t)BOUNCE_BLOCKS * DISK_BLOCK_SIZE)
+
+static int diskfd = -1;
+static char *bounce = NULL;    // aligned transfer buffer (direct only)
+static unsigned fd_blocks;
+
+static int fd_init(const char *filename, int n, int flags) {
+    diskfd = image_open(filename, &n, flags);
+    if (diskfd < 0)
+        return -1;
+    fd_blocks = n;
+    return n;
+}
+
+static int pread_init(const char *filename, int n) {
+    return fd_init(filename, n, 0);
+}
+
+static int direct_init(const char *filename, int n) {
+    if (posix_memalign((void **)&bounce, DIRECT_ALIGN, BOUNCE_SIZE) != 0) {
+        bounce = NULL;
+        return -1;
+    }
+    n = fd_init(filename, n, O_DIRECT);
+    if (n < 0) {
+        free(bounce);
+        bounce = NULL;
+    }
+    return n;
+}
+
+static int pread_read(unsigned start, unsigned count, char *data) {
+    size_t len = (size_t)count * DISK_BLOCK_SIZE;
+    return pread(diskfd, data, len, (off_t)start * DISK_BLOCK_SIZE) == len ? 0 : -1;
+}
+
+static int pread_write(unsigned start, unsigned count, const char *data) {
+    size_t len = (size_t)count * DISK_BLOCK_SIZE;
+    return pwrite(diskfd, data, len, (off_t)start * DISK_BLOCK_SIZE) == len ? 0 : -1;
+}
+
+static int pread_read_sg(unsigned start, unsigned count, char *bufs[]) {
+    struct iovec iov[SG_MAX];
+    for (unsigned done = 0; done < count; done += SG_MAX) {
+        int n = MIN(count - done, SG_MAX);
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = bufs[done + i];
+            iov[i].iov_len = DISK_BLOCK_SIZE;
+        }
+        if (preadv(diskfd, iov, n, (off_t)(start + done) * DISK_BLOCK_SIZE)
+                != (ssize_t)n * DISK_BLOCK_SIZE)
+            return -1;
+    }
+    return 0;
+}
+
+static int pread_write_sg(unsigned start, unsigned count, char *const bufs[]) {
+    struct iovec iov[SG_MAX];
+    for (unsigned done = 0; done < count; done += SG_MAX) {
+        int n = MIN(count - done, SG_MAX);
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = bufs[done + i];
+            iov[i].iov_len = DISK_BLOCK_SIZE;
+        }
+        if (pwritev(diskfd, iov, n, (off_t)(start + done) * DISK_BLOCK_SIZE)
+                != (ssize_t)n * DISK_BLOCK_SIZE)
+            return -1;
+    }
+    return 0;
+}
+
+static int direct_read(unsigned start, unsigned count, char *data) {
+    size_t len = (size_t)count * DISK_BLOCK_SIZE;
+    off_t pos = (off_t)start * DISK_BLOCK_SIZE;
+
+    for (size_t done = 0; done < len; done += BOUNCE_SIZE) {
+        size_t n = MIN(len - done, BOUNCE_SIZE);
+        if (pread(diskfd, bounce, n, pos + done) != n)
+            return -1;
+        memcpy(data + done, bounce, n);
+    }
+    return 0;
+}
+
+static int direct_write(unsigned start, unsigned count, const char *data) {
+    size_t len = (size_t)count * DISK_BLOCK_SIZE;
+    off_t pos = (off_t)start * DISK_BLOCK_SIZE;
+
+    for (size_t done = 0; done < len; done += BOUNCE_SIZE) {
+        size_t n = MIN(len - done, BOUNCE_SIZE);
+        memcpy(bounce, data + done, n);
+        if (pwrite(diskfd, bounce, n, pos + done) != n)
+            return -1;
+    }
+    return 0;
+}
+
+static int fd_discard(unsigned start, unsigned count) {
+    return punch_hole(diskfd, start, count);
+}
+
+static unsigned fd_size() {
+    return fd_blocks;
+}
+
+static void fd_close() {
+    close(diskfd);
+    diskfd = -1;
+    free(bounce);
+    bounce = NULL;
+}
+
+const struct disk_backend disk_pread = {
+    .name = "pread",
+    .init = pread_init,
+    .read = pread_read,
+    .write = pread_write,
+    .read_sg = pread_read_sg,
+    .write_sg = pread_write_sg,
+    .discard = fd_discard,
+    .size = fd_size,
+    .close = fd_close,
+    .parallel = 1
+};
+
+const struct disk_backend disk_direct = {
+    .name = "direct",
+    .init = direct_init,
+    .read = direct_read,
+    .write = direct_write,
+    .discard = fd_discard,
+    .size = fd_size,
+    .close = fd_close,
+    .parallel = 0   // shares the aligned buffer
+};
+
+/*****************************************************/
+
+/* ram: the device lives only in memory; it starts with the contents of
+ * filename if that image exists (else n zeroed blocks) and nothing is
+ * written back to the host, so all changes are lost on close
+ */
+
+static char *ram;
+static unsigned ram_blocks;
+
+static int ram_init(const char *filename, int n) {
+    FILE *f = fopen(filename, "r");
+    if (f != NULL) {
+        fseek(f, 0L, SEEK_END);   // ignore provided n
+        n = ftell(f);
+        fprintf(stderr, "Disk image size=%d, %d blocks\n", n, n / DISK_BLOCK_SIZE);
+        n = n / DISK_BLOCK_SIZE;
+    }
+    if (n < 0 || (ram = calloc(n > 0 ? n : 1, DISK_BLOCK_SIZE)) == NULL) {
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    if (f != NULL) {
+        fseek(f, 0L, SEEK_SET);
+        if (fread(ram, DISK_BLOCK_SIZE, n, f) != n) {
+            fclose(f);
+            free(ram);
+            ram = NULL;
+            return -1;
+        }
+        fclose(f);
+    }
+    ram_blocks = n;
+    return n;
+}
+
+static int ram_read(unsigned start, unsigned count, char *data) {
+    memcpy(data, ram + (size_t)start * DISK_BLOCK_SIZE, (size_t)count * DISK_BLOCK_SIZE);
+    return 0;
+}
+
+static int ram_write(unsigned start, unsigned count, const char *data) {
+    memcpy(ram + (size_t)start * DISK_BLOCK_SIZE, data, (size_t)count * DISK_BLOCK_SIZE);
+    return 0;
+}
+
+static char *ram_block_ptr(unsigned blocknum) {
+    return ram + (size_t)blocknum * DISK_BLOCK_SIZE;
+}
+
+static int ram_discard(unsigned start, unsigned count) {
+    memset(ram + (size_t)start * DISK_BLOCK_SIZE, 0, (size_t)count * DISK_BLOCK_SIZE);
+    return 0;
+}
+
+static unsigned ram_size() {
+    return ram_blocks;
+}
+
+static void ram_close() {
+    free(ram);
+    ram = NULL;
+}
+
+const struct disk_backend disk_ram = {
+    .name = "ram",
+    .init = ram_init,
+    .read = ram_read,
+    .write = ram_write,
+    .block_ptr = ram_block_ptr,
+    .discard = ram_discard,
+    .size = ram_size,
+    .close = ram_close,
+    .parallel = 1
+};
+
+/*****************************************************/
+
+/* stripe: RAID-0 like device spread over several image files (filename is
+ * a comma separated list); the blocks go round-robin over the files in
+ * stripe units of disk_stripe_unit blocks: logical stripe s (blocks
+ * s*unit ... s*unit+unit-1) is row s/nfiles of file s%nfiles
+ */
+
+#define STRIPE_MAX 16   // max image files in a striped device
+
+static int stripefd[STRIPE_MAX];
+static int nstripes = 0;
+static unsigned stripe_unit = 8;   // blocks per stripe unit
+static unsigned stripe_blocks;
+
+/** sets the stripe unit (in blocks) used by the next stripe device
+ */
+void disk_stripe_unit(unsigned blocks) {
+    if (blocks > 0)
+        stripe_unit = blocks;
+}
+
+static void stripe_close() {
+    for (int f = 0; f < nstripes; f++)
+        close(stripefd[f]);
+    nstripes = 0;
+}
+
+static int stripe_init(const char *filename, int n) {
+    char names[strlen(filename) + 1];
+    int nfiles = 1;
+
+    for (const char *c = filename; *c; c++)
+        nfiles += *c == ',';
+    if (nfiles > STRIPE_MAX)
+        return -1;
+    // new files get whole rows, so the size is the same when reopened
+    unsigned rows = n > 0 ? (n + stripe_unit * nfiles - 1) / (stripe_unit * nfiles) : 0;
+    unsigned minblocks = ~0u;
+
+    strcpy(names, filename);
+    nstripes = 0;
+    for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+        int fblocks = rows * stripe_unit;
+        int fd = image_open(name, &fblocks, 0);
+        if (fd < 0) {
+            stripe_close();
+            return -1;
+        }
+        stripefd[nstripes++] = fd;
+        if (fblocks < minblocks)
+            minblocks = fblocks;
+    }
+    if (nstripes == 0)
+        return -1;
+    stripe_blocks = minblocks / stripe_unit * stripe_unit * nstripes;
+    return stripe_blocks;
+}
+
+/** moves count blocks from start to/from data: the stripe units of each
+ *  file in that range are contiguous in the file, so each file gets a
+ *  single preadv/pwritev (per SG_MAX units) with all its pieces
+ */
+static int stripe_xfer(int write, unsigned start, unsigned count, char *data) {
+    for (int f = 0; f < nstripes; f++) {
+        struct iovec iov[SG_MAX];
+        int niov = 0;
+        off_t pos = 0;
+        ssize_t len = 0;
+
+        for (unsigned b = start; b < start + count; ) {
+            unsigned s = b / stripe_unit;
+            unsigned in = b % stripe_unit;
+            unsigned n = MIN(stripe_unit - in, start + count - b);
+            if (s % nstripes == f) {
+                if (niov == 0)
+                    pos = ((off_t)(s / nstripes) * stripe_unit + in) * DISK_BLOCK_SIZE;
+                iov[niov].iov_base = data + (size_t)(b - start) * DISK_BLOCK_SIZE;
+                iov[niov].iov_len = (size_t)n * DISK_BLOCK_SIZE;
+                len += iov[niov++].iov_len;
+            }
+            b += n;
+            if (niov == SG_MAX || (niov > 0 && b == start + count)) {
+                ssize_t r = write ? pwritev(stripefd[f], iov, niov, pos)
+                                  : preadv(stripefd[f], iov, niov, pos);
+                if (r != len)
+                    return -1;
+                niov = 0;
+                len = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int stripe_read(unsigned start, unsigned count, char *data) {
+    return stripe_xfer(0, start, count, data);
+}
+
+static int stripe_write(unsigned start, unsigned count, const char *data) {
+    return stripe_xfer(1, start, count, (char *)data);
+}
+
+static int stripe_discard(unsigned start, unsigned count) {
+    for (unsigned b = start; b < start + count; ) {
+        unsigned s = b / stripe_unit;
+        unsigned in = b % stripe_unit;
+        unsigned n = MIN(stripe_unit - in, start + count - b);
+        if (punch_hole(stripefd[s % nstripes], (s / nstripes) * stripe_unit + in, n) < 0)
+            return -1;
+        b += n;
+    }
+    return 0;
+}
+
+static unsigned stripe_size() {
+    return stripe_blocks;
+}
+
+const struct disk_backend disk_stripe = {
+    .name = "stripe",
+    .init = stripe_init,
+    .read = stripe_read,
+    .write = stripe_write,
+    .discard = stripe_discard,
+    .size = stripe_size,
+    .close = stripe_close,
+    .parallel = 1
+};
+
+/*****************************************************/
+
+// all built-in backends, NULL terminated (the first one is the default)
+const struct disk_backend *disk_backends[] = {
+    &disk_stdio, &disk_mmap, &disk_pread, &disk_direct, &disk_ram, &disk_stripe, NULL
+};
+
+/** returns the built-in backend called name, or NULL if there is none
+ */
+const struct disk_backend *disk_backend_byname(const char *name) {
+    for (int i = 0; disk_backends[i] != NULL; i++)
+        if (strcmp(disk_backends[i]->name, name) == 0)
+            return disk_backends[i];
+    return NULL;
+}
@@ -1,6 +1,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "bitmap.h"
 
@@ -31,16 +36,133 @@ void bitmap_clear(bitmap_t *b, unsigned n) {
 
 /** reads bit n from bitmap array b
  */
-int  bitmap_get(bitmap_t *b, unsigned n) {
+int  bitmap_get(const bitmap_t *b, unsigned n) {
     int word = n / WORDSZ;
     int offset = n % WORDSZ;
     return (b[word] >> offset) & 1;
 }
 
+/*****************************************************/
+
+/* searching and counting 64 bits at a time: bit n is bit n%64 of word n/64,
+ * a little endian load of bytes 8*(n/64) ... (words may be unaligned and
+ * the bitmap may end in the middle of one)
+ */
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+/** returns word w of a bitmap with nbits; bits past nbits read as fill (0 or 1)
+ */
+static uint64_t load_word(const bitmap_t *b, unsigned w, unsigned nbits, int fill) {
+    uint64_t x = fill ? ~0ULL : 0;
+    unsigned nbytes = (nbits + 7) / 8;
+
+    memcpy(&x, b + w * 8, MIN(8, nbytes - w * 8)); // bytes after the end keep fill
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    if (nbits < (w + 1) * 64) {
+        uint64_t past = ~0ULL << (nbits - w * 64);
+        x = fill ? x | past : x & ~past;
+    }
+    return x;
+}
+
+/** returns the first bit >= start that is zero (or one if zero is not set),
+ *  or -1 if there is none before nbits
+ */
+static int find_bit(const bitmap_t *b, unsigned start, unsigned nbits, int zero) {
+    if (start >= nbits)
+        return -1;
+    unsigned nwords = (nbits + 63) / 64;
+    unsigned w = start / 64;
+    uint64_t before = (1ULL << (start % 64)) - 1; // bits to ignore in the first word
+
+    // look for a one in x: ones in the complement when looking for a zero
+    uint64_t x = zero ? ~(load_word(b, w, nbits, 1) | before)
+                      : load_word(b, w, nbits, 0) & ~before;
+    while (x == 0) {
+        if (++w >= nwords)
+            return -1;
+#ifdef __SSE2__
+        // skip 128 bits at a time while they are all full (or all empty)
+        __m128i skip = _mm_set1_epi8(zero ? -1 : 0);
+        while ((w + 2) * 64 <= nbits) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(b + w * 8));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, skip)) != 0xffff)
+                break;
+            w += 2;
+        }
+        if (w >= nwords)
+            return -1;
+#endif
+        x = zero ? ~load_word(b, w, nbits, 1) : load_word(b, w, nbits, 0);
+    }
+    return w * 64 + __builtin_ctzll(x);
+}
+
+/** returns the first bit >= start that is zero, or -1 if all bits from
+ *  start to nbits are set
+ */
+int bitmap_find_first_zero(const bitmap_t *b, unsigned start, unsigned nbits) {
+    return find_bit(b, start, nbits, 1);
+}
+
+/** returns the first bit >= start where len consecutive zero bits begin
+ *  (all before nbits), or -1 if there is no such run
+ */
+int bitmap_find_zero_run(const bitmap_t *b, unsigned start, unsigned nbits, unsigned len) {
+    while (1) {
+        int first = find_bit(b, start, nbits, 1);
+        if (first < 0 || first + len > nbits)
+            return -1;
+        int end = find_bit(b, first, MIN(nbits, first + len), 0); // a one inside the run?
+        if (end < 0)
+            return first;
+        start = end + 1;
+    }
+}
+
+/** returns how many bits are set among the first nbits
+ */
+unsigned bitmap_count(const bitmap_t *b, unsigned nbits) {
+    unsigned n = 0;
+    for (unsigned w = 0; w < (nbits + 63) / 64; w++)
+        n += __builtin_popcountll(load_word(b, w, nbits, 0));
+    return n;
+}
+
+/** sets (if value is 1) or clears count bits from start, whole bytes at once
+ */
+static void fill_range(bitmap_t *b, unsigned start, unsigned count, int value) {
+    unsigned end = start + count;
+    for (; start < end && start % 8 != 0; start++)
+        value ? bitmap_set(b, start) : bitmap_clear(b, start);
+    if (end - start >= 8) {
+        memset(b + start / 8, value ? 0xff : 0, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+    for (; start < end; start++)
+        value ? bitmap_set(b, start) : bitmap_clear(b, start);
+}
+
+/** sets bits start ... start+count-1 to 1
+ */
+void bitmap_set_range(bitmap_t *b, unsigned start, unsigned count) {
+    fill_range(b, start, count, 1);
+}
+
+/** clears bits start ... start+count-1 (sets to 0)
+ */
+void bitmap_clear_range(bitmap_t *b, unsigned start, unsigned count) {
+    fill_range(b, start, count, 0);
+}
+
+/*****************************************************/
+
 /** alloc an array with nbits
 */
 bitmap_t * bitmap_alloc(int nbits) {
-    printf("bits: %i; word size %u;  allocated %i words\n", nbits, WORDSZ, (nbits+WORDSZ-1)/WORDSZ);
     bitmap_t *b = calloc((nbits+WORDSZ-1)/WORDSZ, sizeof(bitmap_t));  // and sets it to zeros
     return b;
 }
@@ -54,7 +176,7 @@ void bitmap_free(bitmap_t *b) {
 
 // for debuging:
 
-void bitmap_print(bitmap_t *b, unsigned size) {
+void bitmap_print(const bitmap_t *b, unsigned size) {
     int col=0;
     for (int i = 0; i < size; i++) {
         printf("%i", bitmap_get(b, i));
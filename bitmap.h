@@ -11,8 +11,15 @@ typedef char  bitmap_t;
 
 void bitmap_set(bitmap_t *b, unsigned n);
 void bitmap_clear(bitmap_t *b, unsigned n);
-int  bitmap_get(bitmap_t *b, unsigned n);
-void bitmap_print(bitmap_t *b, unsigned size);
+int  bitmap_get(const bitmap_t *b, unsigned n);
+void bitmap_set_range(bitmap_t *b, unsigned start, unsigned count);
+void bitmap_clear_range(bitmap_t *b, unsigned start, unsigned count);
+
+// searches and counts among the first nbits bits
+int  bitmap_find_first_zero(const bitmap_t *b, unsigned start, unsigned nbits);
+int  bitmap_find_zero_run(const bitmap_t *b, unsigned start, unsigned nbits, unsigned len);
+unsigned bitmap_count(const bitmap_t *b, unsigned nbits);
+void bitmap_print(const bitmap_t *b, unsigned size);
 
 bitmap_t *bitmap_alloc(int nbits);
 void bitmap_free(bitmap_t *b);
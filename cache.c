@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+/*******
+ * Block buffer cache: a fixed pool of block buffers, found by block number
+ * through a hash table. Writes only update the buffer and mark it dirty
+ * (write-back); dirty buffers reach the disk when they are evicted or on
+ * bcache_flush. Vectored writes (large, sequential) go straight to the disk
+ * and just refresh the buffers they hit.
+ *
+ * With the 2Q policy, blocks first enter a FIFO queue (A1in, a quarter of
+ * the buffers) and only move to the main LRU list (Am) if they are used
+ * again after leaving it, while their number is still remembered in the
+ * A1out ghost queue. A block read once by a scan never gets into Am, so
+ * scans cannot push out the blocks that are used all the time.
+ */
+
+#define NOBLOCK (~0u)   // blocknum of a buffer that holds no block
+#define RA_MAX  32      // max blocks read ahead on a sequential miss
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+struct cbuf {
+    unsigned blocknum;
+    int dirty;
+    int ref;                    // CLOCK: used since the hand last passed
+    int in_a1;                  // 2Q: in A1in (else in Am, the LRU list)
+    struct cbuf *hnext;         // hash chain
+    struct cbuf *prev, *next;   // LRU list (or A1in), most recently used first
+    char data[DISK_BLOCK_SIZE];
+};
+
+static struct cbuf *bufs = NULL;
+static int nbufs = 0;
+static struct cbuf **hash = NULL;
+static unsigned hashmask;
+static struct cbuf lru;          // LRU list head (lru.next is the most recent)
+static int hand = 0;             // CLOCK hand
+static struct cbuf a1in;         // 2Q A1in FIFO head (a1in.next is the newest)
+static int na1in, kin;           // 2Q: buffers in A1in, and its target size
+static unsigned *ghost = NULL;   // 2Q A1out: ring of blocks recently dropped from A1in
+static int ghost_max, ghost_next;
+static enum bcache_policy policy;
+static struct bcache_stats stats;
+static unsigned ra_next = NOBLOCK;  // block that would continue the last sequential miss
+static unsigned ra_window = 0;      // blocks read ahead on the next sequential miss
+
+
+static unsigned hashof(unsigned blocknum) {
+    return (blocknum * 2654435761u) & hashmask;
+}
+
+static struct cbuf *lookup(unsigned blocknum) {
+    struct cbuf *b = hash[hashof(blocknum)];
+    while (b != NULL && b->blocknum != blocknum)
+        b = b->hnext;
+    return b;
+}
+
+static void hash_remove(struct cbuf *b) {
+    struct cbuf **p = &hash[hashof(b->blocknum)];
+    while (*p != b)
+        p = &(*p)->hnext;
+    *p = b->hnext;
+    b->blocknum = NOBLOCK;
+}
+
+static void hash_insert(struct cbuf *b, unsigned blocknum) {
+    b->blocknum = blocknum;
+    b->hnext = hash[hashof(blocknum)];
+    hash[hashof(blocknum)] = b;
+}
+
+static void lru_unlink(struct cbuf *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void list_push(struct cbuf *head, struct cbuf *b) {
+    b->next = head->next;
+    b->prev = head;
+    head->next->prev = b;
+    head->next = b;
+}
+
+static void lru_push(struct cbuf *b) {
+    list_push(&lru, b);
+}
+
+/** remembers blocknum in the 2Q ghost queue (forgetting the oldest one)
+ */
+static void ghost_add(unsigned blocknum) {
+    ghost[ghost_next] = blocknum;
+    ghost_next = (ghost_next + 1) % ghost_max;
+}
+
+/** returns 1 if blocknum was in the 2Q ghost queue (it is removed from it)
+ *  (a linear search, but only on misses, which go to the disk anyway)
+ */
+static int ghost_take(unsigned blocknum) {
+    for (int i = 0; i < ghost_max; i++)
+        if (ghost[i] == blocknum) {
+            ghost[i] = NOBLOCK;
+            return 1;
+        }
+    return 0;
+}
+
+/** marks b as just used
+ */
+static void touch(struct cbuf *b) {
+    if (policy == BCACHE_CLOCK)
+        b->ref = 1;
+    else if (!b->in_a1) { // (2Q: a hit in A1in leaves it where it is)
+        lru_unlink(b);
+        lru_push(b);
+    }
+}
+
+/** writes b to disk if it is dirty
+ */
+static void clean(struct cbuf *b) {
+    if (b->dirty) {
+        disk_write(b->blocknum, b->data);
+        b->dirty = 0;
+        stats.dirty--;
+        stats.writebacks++;
+    }
+}
+
+/** chooses a buffer to reuse, writes it back if needed and empties it
+ */
+static struct cbuf *evict() {
+    struct cbuf *b;
+
+    if (policy == BCACHE_LRU) {
+        b = lru.prev;  // least recently used (empty buffers are kept there)
+    } else if (policy == BCACHE_2Q) {
+        if (lru.prev != &lru && lru.prev->blocknum == NOBLOCK)
+            b = lru.prev;  // an empty buffer
+        else if (na1in > kin || lru.prev == &lru) {
+            b = a1in.prev; // the oldest in A1in: remember it was here
+            ghost_add(b->blocknum);
+        } else
+            b = lru.prev;
+        lru_unlink(b);     // admit puts it back in a list
+        if (b->in_a1) {
+            b->in_a1 = 0;
+            na1in--;
+        }
+    } else {
+        while (1) {
+            b = &bufs[hand];
+            hand = (hand + 1) % nbufs;
+            if (b->blocknum == NOBLOCK || !b->ref)
+                break;
+            b->ref = 0;  // second chance
+        }
+    }
+    if (b->blocknum != NOBLOCK) {
+        clean(b);
+        hash_remove(b);
+        stats.evictions++;
+    }
+    return b;
+}
+
+/** puts blocknum in buffer b (just taken with evict) and marks it used;
+ *  with 2Q it goes to Am if it was in the ghost queue, else to A1in
+ */
+static void admit(struct cbuf *b, unsigned blocknum) {
+    hash_insert(b, blocknum);
+    if (policy != BCACHE_2Q)
+        touch(b);
+    else if (ghost_take(blocknum))
+        lru_push(b);
+    else {
+        list_push(&a1in, b);
+        b->in_a1 = 1;
+        na1in++;
+    }
+}
+
+/** loads count consecutive blocks from start, none of them cached, into
+ *  buffers with a single disk request; count must be small (see RA_MAX)
+ *  so that they do not evict each other
+ */
+static void load_run(unsigned start, unsigned count) {
+    char *data[RA_MAX + 1];
+    struct cbuf *b[RA_MAX + 1];
+
+    for (unsigned i = 0; i < count; i++) {
+        b[i] = evict();
+        admit(b[i], start + i);
+        data[i] = b[i]->data;
+    }
+    disk_read_sg(start, count, data);
+}
+
+/** returns how many blocks from start (up to max) are not cached and can
+ *  be read together
+ */
+static unsigned uncached_run(unsigned start, unsigned max) {
+    unsigned n = 0;
+    max = MIN(max, MIN(disk_size() - start, (unsigned)nbufs / 4 + 1));
+    while (n < max && lookup(start + n) == NULL)
+        n++;
+    return n;
+}
+
+/** returns the buffer with blocknum, loading it from disk if load is set
+ *  (else its contents are undefined, the caller will fill it);
+ *  loads that follow each other read ahead 2, 4, ... RA_MAX blocks more
+ */
+static struct cbuf *get(unsigned blocknum, int load) {
+    struct cbuf *b = lookup(blocknum);
+    if (b != NULL) {
+        stats.hits++;
+        touch(b);
+        return b;
+    }
+    stats.misses++;
+    if (!load) {
+        b = evict();
+        admit(b, blocknum);
+        return b;
+    }
+    if (blocknum == ra_next)
+        ra_window = ra_window == 0 ? 2 : MIN(2 * ra_window, RA_MAX);
+    else
+        ra_window = 0;
+    unsigned n = uncached_run(blocknum, 1 + ra_window);
+    load_run(blocknum, n);
+    stats.readahead += n - 1;
+    ra_next = blocknum + n;
+    return lookup(blocknum);
+}
+
+/** drops the cached copy of blocknum (dirty data is lost)
+ */
+static void drop(unsigned blocknum) {
+    struct cbuf *b = lookup(blocknum);
+    if (b == NULL)
+        return;
+    if (b->dirty) {
+        b->dirty = 0;
+        stats.dirty--;
+    }
+    hash_remove(b);
+    b->ref = 0;
+    if (policy != BCACHE_CLOCK) { // reuse it first
+        lru_unlink(b);
+        if (b->in_a1) {
+            b->in_a1 = 0;
+            na1in--;
+        }
+        b->prev = lru.prev;
+        b->next = &lru;
+        lru.prev->next = b;
+        lru.prev = b;
+    }
+}
+
+/*****************************************************/
+
+/** creates a cache with nbuffers block buffers and the given eviction policy
+ *  (nbuffers == 0 disables it); any previous cache is flushed and freed;
+ *  returns -1 if out of memory, 0 if sucess
+ */
+int bcache_init(int nbuffers, enum bcache_policy p) {
+    bcache_close();
+    if (nbuffers <= 0)
+        return 0;
+
+    unsigned nhash = 1;
+    while (nhash < 2 * nbuffers)
+        nhash <<= 1;
+    bufs = calloc(nbuffers, sizeof(struct cbuf));
+    hash = calloc(nhash, sizeof(struct cbuf *));
+    ghost_max = p == BCACHE_2Q ? nbuffers / 2 + 1 : 0;
+    if (ghost_max > 0) // only 2Q has a ghost queue
+        ghost = malloc(ghost_max * sizeof(unsigned));
+    if (bufs == NULL || hash == NULL || (ghost_max > 0 && ghost == NULL)) {
+        free(bufs);
+        free(hash);
+        free(ghost);
+        bufs = NULL;
+        hash = NULL;
+        ghost = NULL;
+        return -1;
+    }
+    for (int i = 0; i < ghost_max; i++)
+        ghost[i] = NOBLOCK;
+    ghost_next = 0;
+    a1in.next = a1in.prev = &a1in;
+    na1in = 0;
+    kin = nbuffers / 4 + 1;
+    hashmask = nhash - 1;
+    nbufs = nbuffers;
+    policy = p;
+    hand = 0;
+    lru.next = lru.prev = &lru;
+    for (int i = 0; i < nbufs; i++) {
+        bufs[i].blocknum = NOBLOCK;
+        lru_push(&bufs[i]);
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.size = nbufs;
+    ra_next = NOBLOCK;
+    ra_window = 0;
+    return 0;
+}
+
+/** reads one block to data
+ */
+void bcache_read(unsigned blocknum, char *data) {
+    if (nbufs == 0) {
+        disk_read(blocknum, data);
+        return;
+    }
+    memcpy(data, get(blocknum, 1)->data, DISK_BLOCK_SIZE);
+}
+
+/** writes data to one block (reaches the disk later, see bcache_flush)
+ */
+void bcache_write(unsigned blocknum, const char *data) {
+    if (nbufs == 0) {
+        disk_write(blocknum, data);
+        return;
+    }
+    struct cbuf *b = get(blocknum, 0);
+    memcpy(b->data, data, DISK_BLOCK_SIZE);
+    if (!b->dirty) {
+        b->dirty = 1;
+        stats.dirty++;
+    }
+}
+
+/** reads count consecutive blocks from start to data; blocks not in the
+ *  cache are read from disk in runs (one disk_readv each) and cached
+ */
+void bcache_readv(unsigned start, unsigned count, char *data) {
+    if (nbufs == 0) {
+        disk_readv(start, count, data);
+        return;
+    }
+    for (unsigned i = 0; i < count; ) {
+        struct cbuf *b = lookup(start + i);
+        if (b != NULL) {
+            stats.hits++;
+            touch(b);
+            memcpy(data + (size_t)i * DISK_BLOCK_SIZE, b->data, DISK_BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        unsigned run = 1;
+        while (i + run < count && lookup(start + i + run) == NULL)
+            run++;
+        disk_readv(start + i, run, data + (size_t)i * DISK_BLOCK_SIZE);
+        for (unsigned j = i; j < i + run; j++) {
+            b = get(start + j, 0);
+            memcpy(b->data, data + (size_t)j * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+        }
+        i += run;
+    }
+}
+
+/** writes count consecutive blocks from data with a single disk request
+ *  (write-through); cached copies of those blocks are refreshed
+ */
+void bcache_writev(unsigned start, unsigned count, const char *data) {
+    disk_writev(start, count, data);
+    for (unsigned i = 0; i < count && nbufs > 0; i++) {
+        struct cbuf *b = lookup(start + i);
+        if (b != NULL) {
+            memcpy(b->data, data + (size_t)i * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+            if (b->dirty) {
+                b->dirty = 0;
+                stats.dirty--;
+            }
+        }
+    }
+}
+
+/** returns count consecutive blocks from start for reading only, without
+ *  copying when possible: a single block is returned in its cache buffer,
+ *  and all count blocks in device memory if there is no cache and the disk
+ *  is mapped (they are counted as read all the same); else the blocks are
+ *  read into buf (with room for count blocks);
+ *  the result is valid only until the next bcache call
+ */
+const char *bcache_view(unsigned start, unsigned count, char *buf) {
+    if (nbufs == 0) {
+        char *p = disk_block_ptr(start, count);
+        if (p != NULL)
+            return p;
+        disk_readv(start, count, buf);
+        return buf;
+    }
+    if (count == 1)
+        return get(start, 1)->data;
+    bcache_readv(start, count, buf);
+    return buf;
+}
+
+static int cmp_block(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+    return (x > y) - (x < y);
+}
+
+/** reads into the cache the n blocks in list (in any order) that are not
+ *  there yet, one disk request per run of consecutive blocks; only the
+ *  first quarter of the cache size are read; the list is sorted in place
+ */
+void bcache_prefetch(unsigned *list, int n) {
+    if (nbufs == 0)
+        return;
+    n = MIN(n, nbufs / 4 + 1); // the first ones only: they must not evict each other
+    qsort(list, n, sizeof(unsigned), cmp_block);
+    for (int i = 0; i < n; ) {
+        int run = 1;
+        while (i + run < n && run < RA_MAX && list[i + run] == list[i] + run)
+            run++;
+        for (int j = i; j < i + run; ) { // load the pieces that are missing
+            unsigned k = uncached_run(list[j], i + run - j);
+            if (k > 0) {
+                load_run(list[j], k);
+                stats.readahead += k;
+            }
+            j += k + (k == 0);
+        }
+        i += run;
+    }
+}
+
+/** drops count blocks from start (their data is no longer needed) and
+ *  lets the disk discard them; returns the disk_discard result
+ */
+int bcache_discard(unsigned start, unsigned count) {
+    for (unsigned i = 0; i < count && nbufs > 0; i++)
+        drop(start + i);
+    return disk_discard(start, count);
+}
+
+static int cmp_buf(const void *a, const void *b) {
+    unsigned x = (*(struct cbuf *const *)a)->blocknum;
+    unsigned y = (*(struct cbuf *const *)b)->blocknum;
+    return (x > y) - (x < y);
+}
+
+/** writes all dirty blocks to disk, in block order, one disk request per
+ *  run of consecutive blocks
+ */
+void bcache_flush() {
+    if (stats.dirty == 0)
+        return;
+    struct cbuf **dirty = malloc(stats.dirty * sizeof(struct cbuf *));
+    char **data = malloc(stats.dirty * sizeof(char *));
+    int n = 0;
+
+    if (dirty == NULL || data == NULL) { // write them one by one
+        for (int i = 0; i < nbufs; i++)
+            clean(&bufs[i]);
+    } else {
+        for (int i = 0; i < nbufs; i++)
+            if (bufs[i].dirty)
+                dirty[n++] = &bufs[i];
+        qsort(dirty, n, sizeof(struct cbuf *), cmp_buf);
+        for (int i = 0; i < n; ) {
+            int run = 1;
+            data[0] = dirty[i]->data;
+            while (i + run < n && dirty[i + run]->blocknum == dirty[i]->blocknum + run) {
+                data[run] = dirty[i + run]->data;
+                run++;
+            }
+            disk_write_sg(dirty[i]->blocknum, run, data);
+            for (int j = i; j < i + run; j++)
+                dirty[j]->dirty = 0;
+            stats.dirty -= run;
+            stats.writebacks += run;
+            i += run;
+        }
+    }
+    free(dirty);
+    free(data);
+}
+
+/** returns the cache statistics since bcache_init or the last reset
+ */
+struct bcache_stats bcache_stats() {
+    return stats;
+}
+
+/** clears the cache counters
+ */
+void bcache_stats_reset() {
+    stats.hits = stats.misses = stats.writebacks = stats.evictions = stats.readahead = 0;
+}
+
+/** flushes the cache and empties it (another disk may be used next)
+ */
+void bcache_invalidate() {
+    bcache_flush();
+    for (int i = 0; i < nbufs; i++)
+        if (bufs[i].blocknum != NOBLOCK)
+            drop(bufs[i].blocknum);
+    ra_next = NOBLOCK;
+    ra_window = 0;
+}
+
+/** flushes and frees the cache (it is disabled afterwards)
+ */
+void bcache_close() {
+    bcache_flush();
+    free(bufs);
+    free(hash);
+    free(ghost);
+    bufs = NULL;
+    hash = NULL;
+    ghost = NULL;
+    nbufs = 0;
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,36 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+// block buffer cache between the file system and the disk;
+// with 0 buffers (the default) every call goes straight to the disk
+
+enum bcache_policy {
+    BCACHE_LRU = 0,  // evict the least recently used block
+    BCACHE_CLOCK,    // second chance: evict the first block not used since the hand passed
+    BCACHE_2Q        // scan resistant: blocks used only once never reach the main LRU list
+};
+
+struct bcache_stats {
+    unsigned long hits, misses;  // block lookups
+    unsigned long writebacks;    // dirty blocks written to disk
+    unsigned long evictions;     // blocks dropped to make room
+    unsigned long readahead;     // blocks loaded before they were asked for
+    int size;                    // buffers in the cache
+    int dirty;                   // buffers waiting to be written
+};
+
+int  bcache_init( int nbuffers, enum bcache_policy policy );
+void bcache_read( unsigned blocknum, char *data );
+void bcache_write( unsigned blocknum, const char *data );
+void bcache_readv( unsigned start, unsigned count, char *data );
+void bcache_writev( unsigned start, unsigned count, const char *data );
+const char *bcache_view( unsigned start, unsigned count, char *buf );
+void bcache_prefetch( unsigned *list, int n );
+int  bcache_discard( unsigned start, unsigned count );
+void bcache_flush();
+void bcache_invalidate();
+struct bcache_stats bcache_stats();
+void bcache_stats_reset();
+void bcache_close();
+
+#endif
@@ -1,17 +1,229 @@
-
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 
 #include "disk.h"
 
-static FILE *diskfile;
+static const struct disk_backend *backend = &disk_stdio; // device used by disk_init
+static int opened = 0;         // backend holds an open device
 static unsigned nblocks = 0;
-static unsigned nreads = 0;
-static unsigned nwrites = 0;
+static int discard = 0;        // disk_discard releases blocks
+static struct disk_stats stats;
+static unsigned region_start[DISK_NREGIONS];  // first block of each region
+static unsigned region_period = 0; // the regions repeat every so many blocks (0: no)
+static struct disk_model model;   // simulated timing (if simulate is set)
+static int simulate = 0;
+static unsigned head = 0;         // block following the last one transferred
+static FILE *tracefile = NULL;    // records every transfer, if open
+static long long trace_t0;        // when the trace started
+static int tag = 0;               // current operation tag for the trace
+// stats may be updated by the async workers while the caller runs
+static pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+
+// serializes transfers of backends that cannot run them in parallel
+static pthread_mutex_t devlock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*****************************************************/
+
+/* I/O statistics: every transfer is accounted by blocks, bytes, host
+ * requests and latency, and split over the regions set by disk_set_regions.
+ */
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** returns the histogram bucket for a request that took ns nanoseconds
+ */
+static int lat_bucket(long long ns) {
+    int b = 0;
+    for (long long us = ns / 1000; us > 1 && b < DISK_LAT_BUCKETS - 1; us >>= 1)
+        b++;
+    return b;
+}
+
+/** charges the simulated time of transferring count blocks from start:
+ *  a seek (growing with the square root of the distance travelled) plus a
+ *  rotational delay, unless start follows the previous transfer, plus the
+ *  transfer time of each block (statlock must be held)
+ */
+static void charge(unsigned start, unsigned count) {
+    if (start != head) {
+        double dist = start > head ? start - head : head - start;
+        stats.seeks++;
+        stats.vtime_us += model.seek_min_us + model.rotation_us
+            + (model.seek_max_us - model.seek_min_us) * sqrt(dist / (nblocks ? nblocks : 1));
+    }
+    stats.vtime_us += count * model.xfer_us;
+    head = start + count;
+}
+
+/** appends a record to the trace, if there is one; a request longer than
+ *  a record's count can hold is split into consecutive records (statlock
+ *  must be held)
+ */
+static void trace(enum disk_trace_op op, unsigned start, unsigned count) {
+    if (tracefile == NULL)
+        return;
+    struct disk_trace_rec rec = {
+        .time_ns = now_ns() - trace_t0,
+        .op = op,
+        .tag = tag
+    };
+    do {
+        rec.block = start;
+        rec.count = count > UINT16_MAX ? UINT16_MAX : count;
+        fwrite(&rec, sizeof(rec), 1, tracefile);
+        start += rec.count;
+        count -= rec.count;
+    } while (count > 0);
+}
+
+/** records one host request moving count blocks from start
+ */
+static void account(int write, unsigned start, unsigned count, long long ns) {
+    pthread_mutex_lock(&statlock);
+    trace(write ? DISK_TRACE_WRITE : DISK_TRACE_READ, start, count);
+    if (simulate)
+        charge(start, count);
+    if (write) {
+        stats.writes += count;
+        stats.write_bytes += (unsigned long)count * DISK_BLOCK_SIZE;
+        stats.write_reqs++;
+        stats.write_lat[lat_bucket(ns)]++;
+    } else {
+        stats.reads += count;
+        stats.read_bytes += (unsigned long)count * DISK_BLOCK_SIZE;
+        stats.read_reqs++;
+        stats.read_lat[lat_bucket(ns)]++;
+    }
+    // split the range over the groups and the regions it crosses
+    while (count > 0) {
+        unsigned base = region_period ? start - start % region_period : 0;
+        unsigned n = region_period && count > base + region_period - start
+                     ? base + region_period - start : count;
+        unsigned from = start - base, left = n;
+        for (int r = DISK_NREGIONS - 1; r >= 0 && left > 0; r--) {
+            unsigned end = from + left;
+            if (end <= region_start[r])
+                continue;
+            unsigned first = from > region_start[r] ? from : region_start[r];
+            if (write)
+                stats.region[r].writes += end - first;
+            else
+                stats.region[r].reads += end - first;
+            left = first - from;
+        }
+        start += n;
+        count -= n;
+    }
+    pthread_mutex_unlock(&statlock);
+}
+
+/** sets where the bitmap, inode table and data regions start, so that
+ *  transfers are also counted by region (blocks before bitmap are super)
+ */
+void disk_set_regions(unsigned bitmap, unsigned inodes, unsigned data) {
+    pthread_mutex_lock(&statlock);
+    region_start[DISK_SUPER] = 0;
+    region_start[DISK_BITMAP] = bitmap;
+    region_start[DISK_INODES] = inodes;
+    region_start[DISK_DATA] = data;
+    pthread_mutex_unlock(&statlock);
+}
+
+/** makes the regions repeat every group_blocks blocks, as set for the
+ *  first group by disk_set_regions (0: the regions are not repeated)
+ */
+void disk_set_groups(unsigned group_blocks) {
+    pthread_mutex_lock(&statlock);
+    region_period = group_blocks;
+    pthread_mutex_unlock(&statlock);
+}
+
+/** sets the timing model used to charge simulated time (stats.vtime_us)
+ *  to every transfer; NULL stops the simulation
+ */
+void disk_set_model(const struct disk_model *m) {
+    pthread_mutex_lock(&statlock);
+    simulate = m != NULL;
+    if (m)
+        model = *m;
+    head = 0;
+    pthread_mutex_unlock(&statlock);
+}
+
+/** starts recording every transfer to a new trace file (see disk.h);
+ *  the device must be open; returns -1 if error, 0 if sucess
+ */
+int disk_trace_start(const char *filename) {
+    struct disk_trace_hdr hdr = { DISK_TRACE_MAGIC, nblocks };
+
+    if (!opened || tracefile != NULL)
+        return -1;
+    FILE *f = fopen(filename, "w");
+    if (f == NULL)
+        return -1;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    pthread_mutex_lock(&statlock);
+    tracefile = f;
+    trace_t0 = now_ns();
+    pthread_mutex_unlock(&statlock);
+    return 0;
+}
+
+/** stops recording and closes the trace file
+ */
+void disk_trace_stop() {
+    pthread_mutex_lock(&statlock);
+    if (tracefile)
+        fclose(tracefile);
+    tracefile = NULL;
+    pthread_mutex_unlock(&statlock);
+}
+
+/** sets the tag saved in the trace records of the following transfers
+ *  (tells which operation caused them; 0..255)
+ */
+void disk_set_tag(int t) {
+    tag = t;
+}
 
+/** returns a snapshot of the I/O statistics since disk_init or the last reset
+ */
+struct disk_stats disk_stats() {
+    pthread_mutex_lock(&statlock);
+    struct disk_stats s = stats;
+    pthread_mutex_unlock(&statlock);
+    return s;
+}
+
+/** clears the I/O statistics
+ */
+void disk_stats_reset() {
+    pthread_mutex_lock(&statlock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&statlock);
+}
+
+/*****************************************************/
+
+/** selects the backend used by the next disk_init (see disk_backend_byname);
+ *  returns -1 if a device is already open, 0 if sucess
+ */
+int disk_set_backend(const struct disk_backend *b) {
+    if (opened || b == NULL)
+        return -1;
+    backend = b;
+    return 0;
+}
 
 /** opens filename as a virtual disk device;
  *  if n == -1 uses an already available "device";
@@ -19,82 +231,390 @@ static unsigned nwrites = 0;
  *  returns -1 if error, 0 if sucess
  */
 int disk_init(const char *filename, int n) {
-    diskfile = fopen(filename, "r+");
-    if (diskfile != NULL) {
-        fseek(diskfile, 0L, SEEK_END);   // ignore provided n
-        n = ftell(diskfile);
-        fprintf(stderr, "Disk image size=%d, %d blocks\n", n, n / DISK_BLOCK_SIZE);
-        n = n / DISK_BLOCK_SIZE;
-    }
-    if (diskfile==NULL && n>0)
-        diskfile = fopen(filename, "w+");
-    if (diskfile==NULL)
+    n = backend->init(filename, n);
+    if (n < 0)
         return -1;
-
-    ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+    opened = 1;
     nblocks = n;
-    nreads = 0;
-    nwrites = 0;
+    head = 0;
+    disk_stats_reset();
     return 0;
 }
 
 /** returns the device size in blocks
  */
 unsigned disk_size() { 
-	return nblocks; 
+	return opened ? backend->size() : 0; 
 }
 
-/** checks that blocknum and data are valid
+/** checks that blocknum is inside the device
  */
-static void sanity_check(unsigned blocknum, const void *data) {
+static void block_check(unsigned blocknum) {
     if (blocknum >= nblocks) {
         printf("DISK ERROR: blocknum (%d) is too big!\n", blocknum);
         abort();
     }
+}
 
+/** checks that data is a buffer
+ */
+static void data_check(const void *data) {
     if (!data) {
         printf("DISK ERROR: null data pointer!\n");
         abort();
     }
 }
 
-/** reads one disk block to data
+/** checks that blocknum and data are valid
  */
-void disk_read(unsigned blocknum, char *data) {
-    sanity_check(blocknum, data);
+static void sanity_check(unsigned blocknum, const void *data) {
+    block_check(blocknum);
+    data_check(data);
+}
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+/** reports a failed transfer on the simulated disk and aborts
+ */
+static void io_error() {
+    printf("DISK ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+    abort();
+}
 
-    if (fread(data, DISK_BLOCK_SIZE, 1, diskfile) == 1) {
-        nreads++;
-    } else {
-        printf("DISK ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+/** takes devlock if the backend cannot run transfers in parallel;
+ *  returns 1 if the lock was taken
+ */
+static int io_lock() {
+    if (!backend->parallel)
+        pthread_mutex_lock(&devlock);
+    return !backend->parallel;
+}
+
+static void io_unlock(int locked) {
+    if (locked)
+        pthread_mutex_unlock(&devlock);
+}
+
+/** checks that count blocks from start are inside the device
+ */
+static void range_check(unsigned start, unsigned count) {
+    if (count == 0 || start + count < start) {
+        printf("DISK ERROR: bad block count (%u)!\n", count);
         abort();
     }
+    block_check(start);
+    block_check(start + count - 1);
+}
+
+/** reads count consecutive disk blocks, starting at start, to data
+ *  (data must have room for count blocks); uses a single host I/O when possible
+ */
+void disk_readv(unsigned start, unsigned count, char *data) {
+    range_check(start, count);
+    data_check(data);
+    int locked = io_lock();
+    long long t0 = now_ns();
+    if (backend->read(start, count, data) < 0)
+        io_error();
+    io_unlock(locked);
+    account(0, start, count, now_ns() - t0);
+}
+
+/** writes count consecutive disk blocks, starting at start, from data;
+ *  uses a single host I/O when possible
+ */
+void disk_writev(unsigned start, unsigned count, const char *data) {
+    range_check(start, count);
+    data_check(data);
+    int locked = io_lock();
+    long long t0 = now_ns();
+    if (backend->write(start, count, data) < 0)
+        io_error();
+    io_unlock(locked);
+    account(1, start, count, now_ns() - t0);
+}
+
+/** reads count consecutive disk blocks, starting at start, scattering
+ *  block i to bufs[i] (each with room for one block)
+ */
+void disk_read_sg(unsigned start, unsigned count, char *bufs[]) {
+    range_check(start, count);
+    data_check(bufs);
+    if (backend->read_sg == NULL) { // one request through a contiguous buffer
+        char *tmp = malloc((size_t)count * DISK_BLOCK_SIZE);
+        if (tmp == NULL) {
+            for (unsigned i = 0; i < count; i++)
+                disk_readv(start + i, 1, bufs[i]);
+            return;
+        }
+        disk_readv(start, count, tmp);
+        for (unsigned i = 0; i < count; i++)
+            memcpy(bufs[i], tmp + (size_t)i * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+        free(tmp);
+        return;
+    }
+    int locked = io_lock();
+    long long t0 = now_ns();
+    if (backend->read_sg(start, count, bufs) < 0)
+        io_error();
+    io_unlock(locked);
+    account(0, start, count, now_ns() - t0);
+}
+
+/** writes count consecutive disk blocks, starting at start, gathering
+ *  block i from bufs[i]
+ */
+void disk_write_sg(unsigned start, unsigned count, char *const bufs[]) {
+    range_check(start, count);
+    data_check(bufs);
+    if (backend->write_sg == NULL) { // one request through a contiguous buffer
+        char *tmp = malloc((size_t)count * DISK_BLOCK_SIZE);
+        if (tmp == NULL) {
+            for (unsigned i = 0; i < count; i++)
+                disk_writev(start + i, 1, bufs[i]);
+            return;
+        }
+        for (unsigned i = 0; i < count; i++)
+            memcpy(tmp + (size_t)i * DISK_BLOCK_SIZE, bufs[i], DISK_BLOCK_SIZE);
+        disk_writev(start, count, tmp);
+        free(tmp);
+        return;
+    }
+    int locked = io_lock();
+    long long t0 = now_ns();
+    if (backend->write_sg(start, count, bufs) < 0)
+        io_error();
+    io_unlock(locked);
+    account(1, start, count, now_ns() - t0);
+}
+
+/** reads one disk block to data
+ */
+void disk_read(unsigned blocknum, char *data) {
+    disk_readv(blocknum, 1, data);
 }
 
 /** writes data to one disk block
  */
 void disk_write(unsigned blocknum, const char *data) {
+    disk_writev(blocknum, 1, data);
+}
+
+/** enables (on != 0) or disables disk_discard
+ */
+void disk_set_discard(int on) {
+    discard = on;
+}
+
+/** tells the device that count blocks from start are no longer in use, so
+ *  the backend may release their host storage (punch a hole in the image
+ *  file) and they read as zeros afterwards; does nothing unless enabled
+ *  with disk_set_discard; returns 0 if the blocks were released, else -1
+ */
+int disk_discard(unsigned start, unsigned count) {
+    if (!discard || !opened || backend->discard == NULL)
+        return -1;
+    range_check(start, count);
+    int locked = io_lock();
+    int r = backend->discard(start, count);
+    io_unlock(locked);
+    if (r == 0) {
+        pthread_mutex_lock(&statlock);
+        trace(DISK_TRACE_DISCARD, start, count);
+        stats.discards += count;
+        pthread_mutex_unlock(&statlock);
+    }
+    return r;
+}
+
+/** returns a pointer to the count consecutive blocks from blocknum inside
+ *  the device memory (mmap and ram backends), so callers can use them
+ *  without copying (stores through it change the disk); they are counted
+ *  as read; returns NULL if the backend has no such memory (use disk_read
+ *  or disk_readv instead)
+ */
+char *disk_block_ptr(unsigned blocknum, unsigned count) {
+    if (!opened || backend->block_ptr == NULL)
+        return NULL;
+    block_check(blocknum);
+    if (count > 0)
+        block_check(blocknum + count - 1);
+    account(0, blocknum, count, 0);
+    return backend->block_ptr(blocknum);
+}
+
+/*****************************************************/
+
+/* Asynchronous requests: disk_submit_* queue a one block transfer that a
+ * small pool of worker threads performs with disk_read/disk_write; the
+ * caller reaps completions with disk_poll or disk_wait. The data buffer
+ * must stay valid (and untouched) until the request is reaped.
+ * The requests go straight to the device, bypassing the block cache (see
+ * cache.c): a read does not see a block still dirty in the cache, and a
+ * later flush of the cached copy overwrites a write. Callers using both
+ * must bcache_flush before submitting reads, and bcache_discard the blocks
+ * before submitting writes (so that no stale copy stays cached).
+ */
+
+#define QUEUE_DEPTH 32   // max requests submitted and not yet reaped
+#define NWORKERS    4    // worker threads serving the queue
+
+enum req_state { REQ_FREE = 0, REQ_QUEUED, REQ_BUSY, REQ_DONE };
+
+struct disk_req {
+    enum req_state state;
+    int write;          // 1 if this is a write, 0 if a read
+    unsigned blocknum;
+    char *data;
+};
+
+static struct disk_req queue[QUEUE_DEPTH]; // request slots (slot index is the request id)
+static int pending[QUEUE_DEPTH];           // FIFO of queued slots
+static int qhead = 0, qcount = 0;
+static pthread_t workers[NWORKERS];
+static int nworkers = 0;
+static int stopping = 0;
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qwork = PTHREAD_COND_INITIALIZER;  // a request was queued (or stop)
+static pthread_cond_t qdone = PTHREAD_COND_INITIALIZER;  // a request completed
+
+/** worker thread: serves queued requests until the queue is stopped and empty
+ */
+static void *worker(void *arg) {
+    pthread_mutex_lock(&qlock);
+    while (1) {
+        while (qcount == 0 && !stopping)
+            pthread_cond_wait(&qwork, &qlock);
+        if (qcount == 0)
+            break;
+        struct disk_req *r = &queue[pending[qhead]];
+        qhead = (qhead + 1) % QUEUE_DEPTH;
+        qcount--;
+        r->state = REQ_BUSY;
+        pthread_mutex_unlock(&qlock);
+
+        if (r->write)
+            disk_write(r->blocknum, r->data);
+        else
+            disk_read(r->blocknum, r->data);
+
+        pthread_mutex_lock(&qlock);
+        r->state = REQ_DONE;
+        pthread_cond_broadcast(&qdone);
+    }
+    pthread_mutex_unlock(&qlock);
+    return NULL;
+}
+
+/** queues a request (workers are started on first use);
+ *  returns the request id, or -1 if all QUEUE_DEPTH slots are in use
+ */
+static int submit(int write, unsigned blocknum, char *data) {
+    int slot;
+
     sanity_check(blocknum, data);
+    pthread_mutex_lock(&qlock);
+    while (nworkers < NWORKERS
+           && pthread_create(&workers[nworkers], NULL, worker, NULL) == 0)
+        nworkers++;
+    for (slot = 0; slot < QUEUE_DEPTH && queue[slot].state != REQ_FREE; slot++)
+        ;
+    if (slot == QUEUE_DEPTH || nworkers == 0) {
+        pthread_mutex_unlock(&qlock);
+        return -1;
+    }
+    queue[slot].state = REQ_QUEUED;
+    queue[slot].write = write;
+    queue[slot].blocknum = blocknum;
+    queue[slot].data = data;
+    pending[(qhead + qcount) % QUEUE_DEPTH] = slot;
+    qcount++;
+    pthread_cond_signal(&qwork);
+    pthread_mutex_unlock(&qlock);
+    return slot;
+}
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
-    //printf("write block %d (byte offset %d)\n", blocknum, blocknum * DISK_BLOCK_SIZE);
-    if (fwrite(data, DISK_BLOCK_SIZE, 1, diskfile) == 1) {
-        nwrites++;
-    } else {
-        printf("DISK ERROR: couldn't access simulated disk: %s\n", strerror(errno));
-        abort();
+/** starts reading block blocknum into data;
+ *  returns the request id, or -1 if the queue is full (reap some requests first)
+ */
+int disk_submit_read(unsigned blocknum, char *data) {
+    return submit(0, blocknum, data);
+}
+
+/** starts writing data to block blocknum;
+ *  returns the request id, or -1 if the queue is full (reap some requests first)
+ */
+int disk_submit_write(unsigned blocknum, const char *data) {
+    return submit(1, blocknum, (char *)data);
+}
+
+/** reaps one completed request without blocking;
+ *  returns its id, or -1 if no request has completed
+ */
+int disk_poll() {
+    int id = -1;
+
+    pthread_mutex_lock(&qlock);
+    for (int i = 0; i < QUEUE_DEPTH; i++)
+        if (queue[i].state == REQ_DONE) {
+            queue[i].state = REQ_FREE;
+            id = i;
+            break;
+        }
+    pthread_mutex_unlock(&qlock);
+    return id;
+}
+
+/** waits for request id to complete and reaps it; if id == -1 waits for
+ *  any request; returns the reaped id, or -1 if there is nothing to wait for
+ */
+int disk_wait(int id) {
+    pthread_mutex_lock(&qlock);
+    while (1) {
+        int busy = 0, done = -1;
+        for (int i = 0; i < QUEUE_DEPTH; i++) {
+            if (id != -1 && i != id)
+                continue;
+            if (queue[i].state == REQ_DONE) {
+                done = i;
+                break;
+            }
+            if (queue[i].state != REQ_FREE)
+                busy = 1;
+        }
+        if (done != -1) {
+            queue[done].state = REQ_FREE;
+            pthread_mutex_unlock(&qlock);
+            return done;
+        }
+        if (!busy) {
+            pthread_mutex_unlock(&qlock);
+            return -1;
+        }
+        pthread_cond_wait(&qdone, &qlock);
     }
 }
 
+/** finishes all queued requests and stops the worker threads
+ */
+static void queue_stop() {
+    pthread_mutex_lock(&qlock);
+    stopping = 1;
+    pthread_cond_broadcast(&qwork);
+    pthread_mutex_unlock(&qlock);
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    nworkers = 0;
+    stopping = 0;
+    memset(queue, 0, sizeof(queue));  // unreaped requests are dropped
+}
+
 /** close device (closes the file that simulates the disk device)
  */
 void disk_close() {
-    if (diskfile) {
-        //printf("%d disk block reads\n", nreads);
-        //printf("%d disk block writes\n", nwrites);
-        fclose(diskfile);
-        diskfile = 0;
+    queue_stop();
+    disk_trace_stop();
+    if (opened) {
+        backend->close();
+        opened = 0;
+        nblocks = 0;
     }
 }
@@ -1,12 +1,119 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+
 #define DISK_BLOCK_SIZE 1024
 
+// a device backend: how and where the disk blocks are kept (see backends.c);
+// transfers move count consecutive blocks and return 0 if ok, -1 if error
+struct disk_backend {
+    const char *name;
+    int  (*init)(const char *filename, int nblocks); // returns the size in blocks, -1 if error
+    int  (*read)(unsigned start, unsigned count, char *data);
+    int  (*write)(unsigned start, unsigned count, const char *data);
+    int  (*read_sg)(unsigned start, unsigned count, char *bufs[]);         // optional
+    int  (*write_sg)(unsigned start, unsigned count, char *const bufs[]);  // optional
+    char *(*block_ptr)(unsigned blocknum);  // optional: block in device memory
+    int  (*discard)(unsigned start, unsigned count);  // optional: release, then read as zeros
+    unsigned (*size)();
+    void (*close)();
+    int parallel;   // 1 if transfers may run concurrently (from async workers)
+};
+
+extern const struct disk_backend disk_stdio;   // buffered stdio on the image file (default)
+extern const struct disk_backend disk_mmap;    // image file mapped in memory
+extern const struct disk_backend disk_pread;   // positional pread/pwrite on a file descriptor
+extern const struct disk_backend disk_direct;  // as pread, with O_DIRECT (bypasses the host page cache)
+extern const struct disk_backend disk_ram;     // memory only, loaded from the image if it exists
+extern const struct disk_backend disk_stripe;  // striped over the comma separated image files
+extern const struct disk_backend *disk_backends[];  // all of the above, NULL terminated
+
+const struct disk_backend *disk_backend_byname( const char *name );
+void disk_stripe_unit( unsigned blocks );
+
+// disk areas used to break down the I/O statistics (see disk_set_regions)
+enum disk_region {
+    DISK_SUPER = 0,  // blocks before the bitmap
+    DISK_BITMAP,
+    DISK_INODES,
+    DISK_DATA,
+    DISK_NREGIONS
+};
+
+#define DISK_LAT_BUCKETS 16  // bucket i counts requests of [2^i, 2^(i+1)) us (0 also has < 1 us)
+
+// timing of a simulated device (see disk_set_model): a transfer that does not
+// start where the previous one ended pays a seek, growing from seek_min_us
+// (next block) to seek_max_us (across the whole disk), and a rotational delay
+struct disk_model {
+    double seek_min_us;
+    double seek_max_us;
+    double rotation_us;  // average rotational delay after a seek
+    double xfer_us;      // transfer time of one block
+};
+
+#define DISK_MODEL_HDD { 1000, 15000, 4170, 10 }  // like a 7200 rpm desktop disk
+
+struct disk_stats {
+    unsigned long reads, writes;          // blocks transferred
+    unsigned long read_bytes, write_bytes;  // bytes transferred (DISK_BLOCK_SIZE per block)
+    unsigned long read_reqs, write_reqs;  // host requests (a vectored transfer is one)
+    unsigned long read_lat[DISK_LAT_BUCKETS];   // read requests by latency
+    unsigned long write_lat[DISK_LAT_BUCKETS];  // write requests by latency
+    struct {
+        unsigned long reads, writes;      // blocks transferred in this region
+    } region[DISK_NREGIONS];
+    unsigned long discards;  // blocks released by disk_discard
+    unsigned long seeks;  // non sequential transfers (only with a disk_model)
+    double vtime_us;      // simulated device time (only with a disk_model)
+};
+
+// I/O trace file (see disk_trace_start): a header followed by one record
+// per transfer, in the order they were done
+#define DISK_TRACE_MAGIC 0x54505346  // "FSPT"
+
+enum disk_trace_op { DISK_TRACE_READ = 0, DISK_TRACE_WRITE, DISK_TRACE_DISCARD };
+
+struct disk_trace_hdr {
+    uint32_t magic;
+    uint32_t nblocks;    // size of the traced device
+};
+
+struct disk_trace_rec {
+    uint64_t time_ns;    // since the trace started
+    uint32_t block;      // first block
+    uint16_t count;      // number of blocks (a longer request takes several records)
+    uint8_t  op;         // enum disk_trace_op
+    uint8_t  tag;        // operation that caused it (see disk_set_tag)
+};
+
+int disk_set_backend( const struct disk_backend *b );
 int disk_init( const char *filename, int nblocks );
 unsigned disk_size();
 void disk_read( unsigned blocknum, char *data );
 void disk_write( unsigned blocknum, const char *data );
+void disk_readv( unsigned start, unsigned count, char *data );
+void disk_writev( unsigned start, unsigned count, const char *data );
+void disk_read_sg( unsigned start, unsigned count, char *bufs[] );
+void disk_write_sg( unsigned start, unsigned count, char *const bufs[] );
+char *disk_block_ptr( unsigned blocknum, unsigned count );
+// asynchronous one block transfers; they bypass the block cache (cache.h):
+// bcache_flush before reads, bcache_discard the blocks before writes
+int disk_submit_read( unsigned blocknum, char *data );
+int disk_submit_write( unsigned blocknum, const char *data );
+int disk_poll();
+int disk_wait( int id );
+void disk_set_discard( int on );
+int disk_discard( unsigned start, unsigned count );
+void disk_set_regions( unsigned bitmap, unsigned inodes, unsigned data );
+void disk_set_groups( unsigned group_blocks );
+void disk_set_model( const struct disk_model *m );
+struct disk_stats disk_stats();
+void disk_stats_reset();
+int disk_trace_start( const char *filename );
+void disk_trace_stop();
+void disk_set_tag( int tag );
 void disk_close();
 
 
@@ -5,9 +5,12 @@
 #include <stdint.h>
 #include "bitmap.h"
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
 
 /**
  * @author Afonso Neves 70963
@@ -23,6 +26,15 @@
  * 1 ...        start of bitmap with free/used blocks
  * after bitmap follows blocks with inodes (root dir is always inode 0)
  * after inodes follows the data blocks
+ *
+ * or, formated with block groups (see fs_set_groups), the disk is split in
+ * groups of group_blocks blocks, each one laid out as
+ * +0           super block (a copy, made at format, except in group 0)
+ * +1           bitmap of the group's blocks
+ * +2 ...       the group's slice of the inode table (group_inodeblks blocks)
+ * after them   the group's data blocks
+ * inodes are numbered across the groups in order; a file's inode goes in
+ * its directory's group, and a directory's blocks near its inode
  */
 
 #define BLOCKSZ		(DISK_BLOCK_SIZE)
@@ -48,6 +60,10 @@ enum inode_type {
 #define FREE 0
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+#define SCAN_BATCH 8   // blocks read per disk request when scanning the inode table
+#define DIR_PREALLOC 8 // most blocks a directory grows by at once
 
 /*****************************************************/
 
@@ -63,6 +79,12 @@ struct fs_sblock {
     uint16_t inode_cnt;  // number of inodes
     uint16_t inode_blocks;  // number of blocks with inodes
     uint16_t first_datablk; // first block with data or dir
+    uint16_t group_blocks;  // blocks per group (0: no groups, the layout above)
+    uint16_t group_inodeblks; // blocks with inodes in each group
+    uint32_t block_rotor;   // next fit: the search for a free block starts here
+    uint16_t inode_rotor;   // next fit: the search for a free inode starts here
+    uint16_t free_inodes;   // inodes not in use
+    uint32_t free_blocks;   // blocks not in use
 };
 
 // inode describing a file or directory
@@ -95,6 +117,82 @@ union fs_block {
  **/
 struct fs_sblock rootSB;
 
+/** free/use block bitmap of the mounted FS, kept in memory from mount on;
+ *  bmap_dirty has one bit per bitmap block changed since the last sync
+ **/
+static bitmap_t *bmap = NULL;
+static bitmap_t *bmap_dirty = NULL;
+
+/** inodes in use of the mounted FS (in memory only: rebuilt from the inode
+ *  table at mount, kept up to date by inode_save)
+ **/
+static bitmap_t *imap = NULL;
+
+/** rootSB changed since the last sync (the allocation rotors and the free
+ *  counts change on every allocation, they reach the disk with the next sync)
+ **/
+static int sb_dirty = 0;
+
+static int format_groups = 0; // group_blocks of the next format (see fs_set_groups)
+
+/*****************************************************/
+
+/*******
+ * Block groups. Without groups the mounted FS is one "group" with the
+ * whole bitmap and inode table; these return where things are in both
+ * layouts. bmap_size is the number of bitmap blocks either way.
+ */
+
+#define GROUPS (rootSB.group_blocks != 0)
+
+/** returns the number of groups (inode table slices) */
+static int ngroups() {
+    return GROUPS ? rootSB.inode_blocks / rootSB.group_inodeblks : 1;
+}
+
+/** returns how many inode table blocks there are in each group */
+static int group_inodeblks() {
+    return GROUPS ? rootSB.group_inodeblks : rootSB.inode_blocks;
+}
+
+/** returns the first inode table block of group g */
+static int group_inodestart(int g) {
+    return GROUPS ? g * rootSB.group_blocks + 2 : INODESTART;
+}
+
+/** returns the first data block of group g */
+static int group_datastart(int g) {
+    return GROUPS ? group_inodestart(g) + rootSB.group_inodeblks : rootSB.first_datablk;
+}
+
+/** returns how many blocks each bitmap block covers */
+static int bmap_bits() {
+    return GROUPS ? rootSB.group_blocks : BLOCKSZ * 8;
+}
+
+/** returns where bitmap block i is on disk */
+static int bmap_block(int i) {
+    return GROUPS ? i * rootSB.group_blocks + 1 : BITMAPSTART + i;
+}
+
+/** returns the disk block with inode ino */
+static int inode_block(int ino) {
+    int per_group = group_inodeblks() * INODES_PER_BLOCK;
+    return group_inodestart(ino / per_group) + ino % per_group / INODES_PER_BLOCK;
+}
+
+/** returns the group of inode ino */
+static int inode_group(int ino) {
+    return ino / (group_inodeblks() * INODES_PER_BLOCK);
+}
+
+/** returns how many blocks of group g are free */
+static int group_free_blocks(int g) {
+    int first = g * rootSB.group_blocks;
+    return MIN(rootSB.group_blocks, rootSB.block_cnt - first)
+           - bitmap_count(bmap + first / 8, MIN(rootSB.group_blocks, rootSB.block_cnt - first));
+}
+
 /*****************************************************/
 
 /** checks that the global rootSB contains a valid super block of a formated disk
@@ -108,6 +206,182 @@ int check_rootSB() {
     return 0;
 }
 
+/** returns count consecutive blocks from start for reading only, without
+ *  copying them when possible (see bcache_view), else they are read into
+ *  buf (with room for count blocks) by a single request;
+ *  the result is valid only until the next block access
+ */
+static const union fs_block *blocks_view(int start, int count, union fs_block *buf) {
+    return (const union fs_block *)bcache_view(start, count, buf->data);
+}
+
+/** same as blocks_view for a single block
+ */
+static const union fs_block *block_view(int blknum, union fs_block *buf) {
+    return blocks_view(blknum, 1, buf);
+}
+
+/*****************************************************/
+
+/*******
+ * Inode cache: recently used inodes stay in memory, found by number through
+ * a hash table. inode_save only updates the cached copy and marks it dirty;
+ * dirty inodes are written when evicted or on sync, and all the dirty ones
+ * of the same inode table block go in a single block write.
+ * Entries with references (see iget/iput) are never evicted.
+ */
+
+#define ICACHE_BUDGET (16 * 1024)  // default memory for the inode cache (bytes)
+
+struct icache_entry {
+    int ino;                           // -1 if the entry is empty
+    int refs;                          // users holding it
+    int dirty;
+    struct icache_entry *hnext;        // hash chain
+    struct icache_entry *prev, *next;  // LRU list, most recently used first
+    struct fs_inode inode;
+};
+
+static int icache_budget = ICACHE_BUDGET;
+static struct icache_entry *icache = NULL;
+static int icache_n = 0;                 // entries (0: no inode cache)
+static struct icache_entry **ihash = NULL;
+static unsigned ihashmask;
+static struct icache_entry ilru;         // LRU list head
+
+/** sets the memory (in bytes) for the inode cache of the next mount or
+ *  format; 0 disables it
+ */
+void fs_set_icache(int bytes) {
+    icache_budget = bytes;
+}
+
+/** frees the inode cache (dirty inodes are lost)
+ */
+static void icache_destroy() {
+    free(icache);
+    free(ihash);
+    icache = NULL;
+    ihash = NULL;
+    icache_n = 0;
+}
+
+/** (re)creates an empty inode cache within icache_budget bytes
+ */
+static void icache_create() {
+    icache_destroy();
+
+    // each entry also takes about two hash table slots
+    icache_n = icache_budget / (sizeof(struct icache_entry) + 2 * sizeof(struct icache_entry *));
+    if (icache_n <= 0) {
+        icache_n = 0;
+        return;
+    }
+    unsigned nhash = 1;
+    while (nhash < 2 * icache_n)
+        nhash <<= 1;
+    icache = calloc(icache_n, sizeof(struct icache_entry));
+    ihash = calloc(nhash, sizeof(struct icache_entry *));
+    if (icache == NULL || ihash == NULL) {
+        free(icache);
+        free(ihash);
+        icache = NULL;
+        ihash = NULL;
+        icache_n = 0;
+        return;
+    }
+    ihashmask = nhash - 1;
+    ilru.next = ilru.prev = &ilru;
+    for (int i = 0; i < icache_n; i++) {
+        icache[i].ino = -1;
+        icache[i].next = ilru.next;  // push in front
+        icache[i].prev = &ilru;
+        ilru.next->prev = &icache[i];
+        ilru.next = &icache[i];
+    }
+}
+
+static struct icache_entry **icache_slot(int ino) {
+    return &ihash[((unsigned)ino * 2654435761u) & ihashmask];
+}
+
+static struct icache_entry *icache_lookup(int ino) {
+    struct icache_entry *e = *icache_slot(ino);
+    while (e != NULL && e->ino != ino)
+        e = e->hnext;
+    return e;
+}
+
+/** writes the dirty cached inodes in the inode table block of ino
+ *  (a single block read-modify-write)
+ */
+static void icache_writeblock(int ino) {
+    union fs_block block;
+    int first = ino - ino % INODES_PER_BLOCK;
+    int inodeBlock = inode_block(ino);
+
+    bcache_read(inodeBlock, block.data);
+    for (int i = 0; i < INODES_PER_BLOCK; i++) {
+        struct icache_entry *e = icache_lookup(first + i);
+        if (e != NULL && e->dirty) {
+            block.inode[i] = e->inode;
+            e->dirty = 0;
+        }
+    }
+    bcache_write(inodeBlock, block.data);
+}
+
+/** writes all the dirty cached inodes
+ */
+static void icache_sync() {
+    for (int i = 0; i < icache_n; i++)
+        if (icache[i].dirty)
+            icache_writeblock(icache[i].ino);
+}
+
+/** returns the cache entry of inode ino with one more reference, loading
+ *  it if needed; returns NULL if there is no cache or all entries are held
+ */
+static struct icache_entry *iget(int ino) {
+    if (icache_n == 0)
+        return NULL;
+    struct icache_entry *e = icache_lookup(ino);
+    if (e == NULL) {
+        for (e = ilru.prev; e != &ilru && e->refs > 0; e = e->prev)
+            ;  // least recently used entry not held
+        if (e == &ilru)
+            return NULL;
+        if (e->ino != -1) {
+            if (e->dirty)
+                icache_writeblock(e->ino);
+            struct icache_entry **p = icache_slot(e->ino);
+            while (*p != e)
+                p = &(*p)->hnext;
+            *p = e->hnext;
+        }
+        union fs_block buf;
+        int inodeBlock = inode_block(ino);
+        e->inode = block_view(inodeBlock, &buf)->inode[ino % INODES_PER_BLOCK];
+        e->ino = ino;
+        e->hnext = *icache_slot(ino);
+        *icache_slot(ino) = e;
+    }
+    e->refs++;
+    e->prev->next = e->next;  // move to the front of the LRU list
+    e->next->prev = e->prev;
+    e->next = ilru.next;
+    e->prev = &ilru;
+    ilru.next->prev = e;
+    ilru.next = e;
+    return e;
+}
+
+/** drops a reference taken with iget
+ */
+static void iput(struct icache_entry *e) {
+    e->refs--;
+}
+
 /** load from disk the inode ino_number into ino (must be an initialized pointer);
  *  returns 0 if inode read. The ino.type == FREE if ino_number is of a free inode;
  *  returns -1 ino_number outside the existing limits.
@@ -120,13 +394,19 @@ int inode_load(int ino_number, struct fs_inode *ino) {
         ino->type = FREE;
         return -1;
     }
-    int inodeBlock = rootSB.first_inodeblk + (ino_number / INODES_PER_BLOCK);
-    disk_read(inodeBlock, block.data);
-    *ino = block.inode[ino_number % INODES_PER_BLOCK];
+    struct icache_entry *e = iget(ino_number);
+    if (e != NULL) {
+        *ino = e->inode;
+        iput(e);
+        return 0;
+    }
+    int inodeBlock = inode_block(ino_number);
+    *ino = block_view(inodeBlock, &block)->inode[ino_number % INODES_PER_BLOCK];
     return 0;
 }
 
-/** save to disk the inode ino to the ino_number position;
+/** save to disk the inode ino to the ino_number position
+ *  (with the inode cache it gets there on eviction or sync);
  *  returns 0 if saved;
  *  if ino_number is outside limits, nothing is done and returns -1
  */
@@ -137,28 +417,79 @@ int inode_save(int ino_number, struct fs_inode *ino) {
         printf("inode_save: inode number too big\n");
         return -1;
     }
-    int inodeBlock = rootSB.first_inodeblk + (ino_number / INODES_PER_BLOCK);
-    disk_read(inodeBlock, block.data); // read full block
+    if ((ino->type != IFFREE) != bitmap_get(imap, ino_number)) { // allocated or freed
+        if (ino->type == IFFREE) {
+            bitmap_clear(imap, ino_number);
+            rootSB.free_inodes++;
+        } else {
+            bitmap_set(imap, ino_number);
+            rootSB.free_inodes--;
+        }
+        sb_dirty = 1;
+    }
+    struct icache_entry *e = iget(ino_number);
+    if (e != NULL) {
+        e->inode = *ino;
+        e->dirty = 1;
+        iput(e);
+        return 0;
+    }
+    int inodeBlock = inode_block(ino_number);
+    bcache_read(inodeBlock, block.data); // read full block
     block.inode[ino_number % INODES_PER_BLOCK] = *ino; // update inode
-    disk_write(inodeBlock, block.data); // write block
+    bcache_write(inodeBlock, block.data); // write block
     return 0;
 }
 
-/** finds an inode not in use (disk is not changed)
+/** finds an inode not in use in imap (disk is not changed), next fit: the
+ *  search starts at the inode rotor and wraps around to the first inode
  *  returns the inode number;  or -1 if no more inodes.
  */
 int inode_alloc() {
-    int inodeBlock = 0;
-    do {
-        union fs_block block;
-        disk_read(INODESTART + inodeBlock, block.data);
-        for (int i = 0; i < INODES_PER_BLOCK; i++)
-            if (block.inode[i].type == IFFREE) {
-                return inodeBlock * INODES_PER_BLOCK + i;
-            }
-        inodeBlock++;
-    } while (inodeBlock < rootSB.inode_blocks);
+    int rotor = rootSB.inode_rotor;
+    int ino = bitmap_find_first_zero(imap, rotor, rootSB.inode_cnt);
+
+    if (ino < 0)
+        ino = bitmap_find_first_zero(imap, 0, rotor);
+    if (ino < 0)
+        return -1; // no more inodes
+    if (ino != rotor) {
+        rootSB.inode_rotor = ino; // not in use yet, the next search skips it then
+        sb_dirty = 1;
+    }
+    return ino;
+}
 
+/** finds an inode not in use for a new file (is_dir == 0) or directory in
+ *  directory parent_ino (disk is not changed); with block groups a file
+ *  goes in its parent's group, and a directory in the group with the most
+ *  free blocks, so directories spread over the disk with room for their
+ *  files (then the next groups, if that one has no free inodes); without
+ *  groups it's inode_alloc
+ *  returns the inode number;  or -1 if no more inodes.
+ */
+static int inode_alloc_near(int parent_ino, int is_dir) {
+    if (!GROUPS)
+        return inode_alloc();
+
+    int per_group = rootSB.group_inodeblks * INODES_PER_BLOCK;
+    int g0 = inode_group(parent_ino);
+    if (is_dir) {
+        int most = -1;
+        for (int g = 0; g < ngroups(); g++) {
+            int nfree = group_free_blocks(g);
+            if (nfree > most && bitmap_count(imap + g * per_group / 8, per_group) < per_group) {
+                most = nfree;
+                g0 = g;
+            }
+        }
+    }
+    for (int i = 0; i < ngroups(); i++) {
+        int g = (g0 + i) % ngroups();
+        int ino = bitmap_find_first_zero(imap, g * per_group, (g + 1) * per_group);
+        if (ino >= 0)
+            return ino;
+    }
     return -1; // no more inodes
 }
 
@@ -176,44 +507,200 @@ int inode_free(int ino_number) {
 
 
 
-/** finds a free disk data block in the bitmap and marks it in use;
- *  returns the block number; returns -1 if no more free blocks.
+/** frees the in-memory bitmaps of the FS */
+static void bmap_destroy() {
+    bitmap_free(bmap);
+    bitmap_free(bmap_dirty);
+    bitmap_free(imap);
+    bmap = bmap_dirty = imap = NULL;
+}
+
+/** allocates the in-memory bitmaps of the FS in rootSB (all blocks and
+ *  inodes free, but the blocks after the last group);
+ *  returns -1 if out of memory
  */
-int block_alloc() {
+static int bmap_create() {
+    int nbits = rootSB.bmap_size * bmap_bits();
+
+    bmap_destroy();
+    bmap = bitmap_alloc(MAX(nbits, rootSB.block_cnt));
+    bmap_dirty = bitmap_alloc(rootSB.bmap_size);
+    imap = bitmap_alloc(rootSB.inode_cnt);
+    if (bmap == NULL || bmap_dirty == NULL || imap == NULL)
+        return -1;
+    if (nbits < rootSB.block_cnt) // too few to make a group: never used
+        bitmap_set_range(bmap, nbits, rootSB.block_cnt - nbits);
+    return 0;
+}
+
+/** copies bitmap block i from the in-memory bitmap into block */
+static void bmap_getblock(int i, union fs_block *block) {
+    memset(block->data, 0, BLOCKSZ);
+    memcpy(block->data, bmap + i * bmap_bits() / 8, bmap_bits() / 8);
+}
+
+/** loads the whole bitmap from disk (a single request), and builds the
+ *  map of inodes in use from the inode table (SCAN_BATCH blocks per request);
+ *  returns -1 if out of memory
+ */
+static int bmap_load() {
+    union fs_block buf[SCAN_BATCH];
+
+    if (bmap_create() == -1)
+        return -1;
+    if (!GROUPS)
+        bcache_readv(BITMAPSTART, rootSB.bmap_size, bmap);
+    for (int i = 0; GROUPS && i < rootSB.bmap_size; i++) {
+        bcache_read(bmap_block(i), buf[0].data);
+        memcpy(bmap + i * bmap_bits() / 8, buf[0].data, bmap_bits() / 8);
+    }
+    // each group's slice of the inode table
+    for (int g = 0; g < ngroups(); g++)
+        for (int first = 0; first < group_inodeblks(); first += SCAN_BATCH) {
+            int n = MIN(SCAN_BATCH, group_inodeblks() - first);
+            int ino = (g * group_inodeblks() + first) * INODES_PER_BLOCK;
+            const union fs_block *blocks = blocks_view(group_inodestart(g) + first, n, buf);
+            for (int i = 0; i < n * INODES_PER_BLOCK && ino + i < rootSB.inode_cnt; i++)
+                if (blocks[i / INODES_PER_BLOCK].inode[i % INODES_PER_BLOCK].type != IFFREE)
+                    bitmap_set(imap, ino + i);
+        }
+    return 0;
+}
+
+/** writes the bitmap blocks changed since the last sync
+ */
+static void bmap_sync() {
     union fs_block block;
-    int bitmapBlock = 0;
-
-    do {
-        disk_read(BITMAPSTART + bitmapBlock, block.data);
-        for (int i = 0; i < BLOCKSZ * 8 && bitmapBlock * BLOCKSZ * 8 + i < rootSB.block_cnt; i++)
-            if (bitmap_get(block.data, i) == 0) {
-                bitmap_set(block.data, i); // found one free, mark it in use
-                disk_write(BITMAPSTART + bitmapBlock, block.data);
-                return bitmapBlock * BLOCKSZ * 8 + i;
-            }
-        bitmapBlock++;
-    } while (bitmapBlock < rootSB.bmap_size);
 
-    return -1; // no free space left on disk
+    for (int i = 0; i < rootSB.bmap_size; i++)
+        if (bitmap_get(bmap_dirty, i)) {
+            bmap_getblock(i, &block);
+            bcache_write(bmap_block(i), block.data);
+            bitmap_clear(bmap_dirty, i);
+        }
+}
+
+/** marks the n blocks from first in use (used = 1) or free in the bitmap,
+ *  and the bitmap blocks they are in as changed; keeps free_blocks right
+ */
+static void bmap_mark(int first, int n, int used) {
+    int changed = 0; // blocks that were not already so
+
+    for (int i = 0; i < n; i++)
+        changed += bitmap_get(bmap, first + i) != used;
+    rootSB.free_blocks += used ? -changed : changed;
+    sb_dirty = 1;
+    if (used)
+        bitmap_set_range(bmap, first, n);
+    else
+        bitmap_clear_range(bmap, first, n);
+    for (int b = first / bmap_bits(); b <= (first + n - 1) / bmap_bits(); b++)
+        bitmap_set(bmap_dirty, b);
+}
+
+/** writes the superblock if it changed since the last sync
+ */
+static void sb_sync() {
+    if (sb_dirty) {
+        union fs_block sb = { .super = rootSB }; // the rest of the block is zeros
+        bcache_write(SBLOCK, sb.data);
+        sb_dirty = 0;
+    }
+}
+
+/** allocates up to want contiguous free blocks and marks them in use:
+ *  at goal if that block is free (e.g. the one after the file's last block),
+ *  else the first run of want free blocks, else the first free block with
+ *  the free ones after it; the searches start at goal, if there is one
+ *  (goal <= 0: none), or else next fit at the block rotor, after the last
+ *  block given; they wrap around to the first data block
+ *  returns the first block of the run and its length in *got;
+ *  returns -1 if no more free blocks.
+ */
+int block_alloc_run(int goal, int want, int *got) {
+    int has_goal = goal >= rootSB.first_datablk && goal < rootSB.block_cnt;
+    int from = has_goal ? goal : rootSB.block_rotor, first = -1;
+
+    if (has_goal && !bitmap_get(bmap, goal))
+        first = goal;
+    if (first < 0) {
+        first = bitmap_find_zero_run(bmap, from, rootSB.block_cnt, want);
+        if (first < 0)
+            first = bitmap_find_zero_run(bmap, rootSB.first_datablk,
+                                         MIN(rootSB.block_cnt, from + want - 1), want);
+    }
+    if (first < 0) {
+        first = bitmap_find_first_zero(bmap, from, rootSB.block_cnt);
+        if (first < 0)
+            first = bitmap_find_first_zero(bmap, rootSB.first_datablk, from);
+        if (first < 0)
+            return -1; // no free space left on disk
+    }
+
+    int n = 1;
+    while (n < want && first + n < rootSB.block_cnt && !bitmap_get(bmap, first + n))
+        n++;
+    bmap_mark(first, n, 1);
+    if (!has_goal) {
+        rootSB.block_rotor = first + n < rootSB.block_cnt ? first + n : rootSB.first_datablk;
+        sb_dirty = 1;
+    }
+    *got = n;
+    return first;
+}
+
+/** finds a free disk data block in the bitmap and marks it in use
+ *  (next fit, see block_alloc_run);
+ *  returns the block number; returns -1 if no more free blocks.
+ */
+int block_alloc() {
+    int got;
+    return block_alloc_run(0, 1, &got);
 }
 
-/** marks nblock as free in the bitmap
+/** marks nblock as free in the bitmap (the block contents are kept)
  *  returns 0 if ok;  return -1 if error (nblock not valid).
  */
-int block_free(int nblock) {
-    union fs_block block;
-    int bitmapBlock = nblock / (BLOCKSZ * 8); // bitmap block where this bit is
-    int offsetBlock = nblock % (BLOCKSZ * 8); // offset inside this block
-    if (bitmapBlock >= rootSB.bmap_size || bitmapBlock < 0)
+static int block_release(int nblock) {
+    if (nblock >= rootSB.block_cnt || nblock < 0)
         return -1; // outside disk size; ignore it
 
     // printf("block_free: %d\n", nblock);
-    disk_read(BITMAPSTART + bitmapBlock, block.data);
-    bitmap_clear(block.data, offsetBlock);
-    disk_write(BITMAPSTART + bitmapBlock, block.data); // update disk
+    bmap_mark(nblock, 1, 0);
+    return 0;
+}
+
+/** marks nblock as free in the bitmap and lets the device discard it
+ *  returns 0 if ok;  return -1 if error (nblock not valid).
+ */
+int block_free(int nblock) {
+    if (block_release(nblock) == -1)
+        return -1;
+    bcache_discard(nblock, 1);
     return 0;
 }
 
+static int cmp_block(const void *a, const void *b) {
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+/** frees the n blocks in list (valid block numbers) and lets the device
+ *  discard them; list is sorted so that each run of consecutive blocks is
+ *  one range in the bitmap and one discard request, and each bitmap block
+ *  is changed once per run (it reaches the disk once, with the next sync)
+ */
+static void blocks_free(uint16_t *list, int n) {
+    qsort(list, n, sizeof(uint16_t), cmp_block);
+    for (int i = 0; i < n; ) {
+        int run = 1;
+        while (i + run < n && list[i + run] == list[i] + run)
+            run++;
+        bmap_mark(list[i], run, 0);
+        bcache_discard(list[i], run);
+        i += run;
+    }
+}
+
 /*****************************************************/
 
 /** finds the disk block number that contains the byte at the given offset
@@ -227,9 +714,8 @@ int offset2block(struct fs_inode *inode, int offset) {
         return inode->dir_block[blkindex];
     } else if (blkindex < DIRBLOCK_PER_INODE + BLOCKSZ / sizeof(uint16_t)) {
         // blkindex is in the indirect block of indexes
-        uint16_t data[BLOCKSZ / sizeof(uint16_t)];
-
-        disk_read(inode->indir_block, (char*)data);
+        union fs_block buf;
+        const uint16_t *data = (const uint16_t *)block_view(inode->indir_block, &buf)->data;
         return data[blkindex - DIRBLOCK_PER_INODE];
     } else {
         // there is no double indirects in this FS so blkindex is too big
@@ -238,29 +724,284 @@ int offset2block(struct fs_inode *inode, int offset) {
     }
 }
 
+/*******
+ * Directory walks: visit the blocks of a directory in order, reading its
+ * indirect block once per walk instead of once per block, with read-ahead:
+ * when the walk gets past the blocks already prefetched, the next ones are
+ * read into the block cache together (1, 2, 4, ... DIR_READAHEAD blocks,
+ * growing while the walk goes on)
+ */
+
+#define DIR_READAHEAD 32  // max blocks prefetched at a time
+
+struct dir_walk {
+    struct fs_inode *inode;
+    int nblocks;          // blocks with dirents
+    int ahead;            // blocks [0, ahead) have been prefetched
+    int window;           // blocks to prefetch next time
+    uint16_t indir[BLOCKSZ / sizeof(uint16_t)];  // the indirect block, if used
+};
+
+static void dir_walk_start(struct dir_walk *w, struct fs_inode *inode) {
+    int entries = inode->size / sizeof(struct fs_dirent);
+    w->inode = inode;
+    w->nblocks = MIN((entries + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK,
+                     DIRBLOCK_PER_INODE + BLOCKSZ / sizeof(uint16_t));
+    w->ahead = 0;
+    w->window = 1;
+    if (w->nblocks > DIRBLOCK_PER_INODE)
+        bcache_read(inode->indir_block, (char *)w->indir);
+}
+
+static int dir_walk_map(struct dir_walk *w, int i) {
+    return i < DIRBLOCK_PER_INODE ? w->inode->dir_block[i] : w->indir[i - DIRBLOCK_PER_INODE];
+}
+
+/** returns the disk block number of block i of the directory, or -1 if
+ *  there is no such block
+ */
+static int dir_walk_block(struct dir_walk *w, int i) {
+    if (i >= w->nblocks)
+        return -1;
+    if (i >= w->ahead) {
+        unsigned list[DIR_READAHEAD];
+        int n = 0;
+        for (int k = i; k < i + w->window && k < w->nblocks; k++)
+            if (dir_walk_map(w, k) > 0)
+                list[n++] = dir_walk_map(w, k);
+        bcache_prefetch(list, n);
+        w->ahead = i + w->window;
+        w->window = MIN(2 * w->window, DIR_READAHEAD);
+    }
+    return dir_walk_map(w, i);
+}
+
 /*****************************************************/
 
-/** find name in the directory given by dir_inode;
+/*******
+ * Directory name filters: a Bloom filter with the names of a directory,
+ * built the first time the whole directory is scanned, answers most
+ * "name does not exist" questions (create, mkdir, link) without reading it.
+ * Names added to the directory are added to its filter; removed names stay
+ * (a false "maybe" only costs a scan). Filters are reused in FIFO order.
+ */
+
+#define DFILTER_DIRS   8        // directories with a filter
+#define DFILTER_BITS   65536    // bits per filter (a full directory has ~8400 names)
+#define DFILTER_HASHES 4        // bits set per name
+
+struct dfilter {
+    int dir;                    // directory inode number (-1: not in use)
+    unsigned char bits[DFILTER_BITS / 8];
+};
+
+static struct dfilter dfilters[DFILTER_DIRS];
+static int dfnext = 0;          // next filter to reuse
+
+/** sets h1 and h2 for name (as a dirent keeps it, up to MAXFILENAME-1 chars)
+ */
+static void dfilter_hash(const char *name, uint32_t *h1, uint32_t *h2) {
+    uint64_t h = 14695981039346656037ull;  // 64 bit FNV-1a
+    for (int i = 0; i < MAXFILENAME - 1 && name[i]; i++)
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ull;
+    *h1 = h;
+    *h2 = (h >> 32) | 1;
+}
+
+/** adds name to filter f
+ */
+static void dfilter_add(struct dfilter *f, const char *name) {
+    uint32_t h1, h2;
+    dfilter_hash(name, &h1, &h2);
+    for (int i = 0; i < DFILTER_HASHES; i++)
+        bitmap_set((bitmap_t *)f->bits, (h1 + i * h2) % DFILTER_BITS);
+}
+
+/** returns 0 if name is certainly not in filter f
+ */
+static int dfilter_maybe(const struct dfilter *f, const char *name) {
+    uint32_t h1, h2;
+    dfilter_hash(name, &h1, &h2);
+    for (int i = 0; i < DFILTER_HASHES; i++)
+        if (!bitmap_get((const bitmap_t *)f->bits, (h1 + i * h2) % DFILTER_BITS))
+            return 0;
+    return 1;
+}
+
+/** returns the filter of directory dir, or NULL if it has none
+ */
+static struct dfilter *dfilter_get(int dir) {
+    for (int i = 0; i < DFILTER_DIRS; i++)
+        if (dfilters[i].dir == dir)
+            return &dfilters[i];
+    return NULL;
+}
+
+/** returns an empty filter for directory dir (replacing an old one)
+ */
+static struct dfilter *dfilter_new(int dir) {
+    struct dfilter *f = &dfilters[dfnext];
+    dfnext = (dfnext + 1) % DFILTER_DIRS;
+    f->dir = dir;
+    memset(f->bits, 0, sizeof(f->bits));
+    return f;
+}
+
+/** forgets all filters (a new FS is mounted or formatted)
+ */
+static void dfilter_clear() {
+    for (int i = 0; i < DFILTER_DIRS; i++)
+        dfilters[i].dir = -1;
+    dfnext = 0;
+}
+
+/*****************************************************/
+
+/** find name in the directory given by dir_inode; if filter is not NULL
+ *  the whole directory is scanned and all its names are added to filter;
  *  returns its inode number (from dirent); or -1 if error or not found
  */
-int dir_findname(struct fs_inode *dir_inode, char *name) {
+static int dir_scan(struct fs_inode *dir_inode, char *name, struct dfilter *filter) {
     if (dir_inode->type!=IFDIR) return -1; // not a directory
     int remaining_dirents = dir_inode->size / sizeof(struct fs_dirent);
     int offset = 0;
-    union fs_block block;
+    int found = -1;
+    union fs_block buf;
+    struct dir_walk walk;
 
+    dir_walk_start(&walk, dir_inode);
     while ( remaining_dirents>0 ) {
-        int currBlock = offset2block(dir_inode, offset);
-        disk_read(currBlock, block.data);
+        int currBlock = dir_walk_block(&walk, offset / BLOCKSZ);
+        const union fs_block *block = block_view(currBlock, &buf);
         for (int d = 0; d < DIRENTS_PER_BLOCK && d < remaining_dirents; d++) {
-            if (block.dirent[d].d_ino!=FREE
-                && strncmp(block.dirent[d].d_name, name, MAXFILENAME) == 0)
-                return block.dirent[d].d_ino;  // found!
+            if (block->dirent[d].d_ino == FREE)
+                continue;
+            if (filter != NULL)
+                dfilter_add(filter, block->dirent[d].d_name);
+            if (found == -1 && strncmp(block->dirent[d].d_name, name, MAXFILENAME) == 0) {
+                found = block->dirent[d].d_ino;
+                if (filter == NULL)
+                    return found;
+            }
         }
         remaining_dirents -= DIRENTS_PER_BLOCK;
         offset += DIRENTS_PER_BLOCK * sizeof(struct fs_dirent);
     }
-    return -1;  // not found
+    return found;
+}
+
+/** find name in the directory given by dir_inode;
+ *  returns its inode number (from dirent); or -1 if error or not found
+ */
+int dir_findname(struct fs_inode *dir_inode, char *name) {
+    return dir_scan(dir_inode, name, NULL);
+}
+
+/*****************************************************/
+
+/*******
+ * Dentry cache: remembers (directory inode, name) -> inode number for the
+ * names found or added, so that path resolution does not need to read the
+ * directories again. Entries are reused in FIFO order; every change to a
+ * directory (add_entry_to_directory, dir_remove_entry) updates it.
+ */
+
+#define DCACHE_SIZE 1024  // names remembered
+
+struct dentry {
+    int dir;                  // directory inode number (-1: entry not in use)
+    int ino;                  // inode with that name
+    char name[MAXFILENAME];
+    struct dentry *hnext;     // hash chain
+};
+
+static struct dentry dcache[DCACHE_SIZE];
+static struct dentry *dhash[2 * DCACHE_SIZE];
+static int dnext = 0;         // next entry to reuse
+
+static struct dentry **dcache_slot(int dir, const char *name) {
+    unsigned h = 2166136261u ^ dir;  // FNV-1a of the name, seeded by dir
+    for (const char *c = name; *c; c++)
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    return &dhash[h % (2 * DCACHE_SIZE)];
+}
+
+/** forgets all names (a new FS is mounted or formatted)
+ */
+static void dcache_clear() {
+    for (int i = 0; i < DCACHE_SIZE; i++)
+        dcache[i].dir = -1;
+    memset(dhash, 0, sizeof(dhash));
+    dnext = 0;
+}
+
+/** returns the inode of name in directory dir, or -1 if not cached
+ */
+static int dcache_lookup(int dir, const char *name) {
+    if (strlen(name) >= MAXFILENAME)
+        return -1; // never cached, see dcache_add
+    for (struct dentry *d = *dcache_slot(dir, name); d != NULL; d = d->hnext)
+        if (d->dir == dir && strcmp(d->name, name) == 0)
+            return d->ino;
+    return -1;
+}
+
+/** forgets name in directory dir
+ */
+static void dcache_remove(int dir, const char *name) {
+    for (struct dentry **p = dcache_slot(dir, name); *p != NULL; p = &(*p)->hnext)
+        if ((*p)->dir == dir && strncmp((*p)->name, name, MAXFILENAME) == 0) {
+            (*p)->dir = -1;
+            *p = (*p)->hnext;
+            return;
+        }
+}
+
+/** remembers that name in directory dir is inode ino
+ */
+static void dcache_add(int dir, const char *name, int ino) {
+    if (strlen(name) >= MAXFILENAME)
+        return; // dirents keep it truncated: let the lookups read the directory
+    struct dentry *d = &dcache[dnext];
+    dnext = (dnext + 1) % DCACHE_SIZE;
+    if (d->dir != -1)
+        dcache_remove(d->dir, d->name);
+    d->dir = dir;
+    d->ino = ino;
+    strcpy(d->name, name);
+    d->hnext = *dcache_slot(dir, name);
+    *dcache_slot(dir, name) = d;
+}
+
+/** finds name in the directory dir_ino (dir_inode is its inode), first in
+ *  the dentry cache, then asking its name filter (the first scan of the
+ *  directory builds it); returns its inode number; or -1 if error or not found
+ */
+static int dir_lookup(int dir_ino, struct fs_inode *dir_inode, char *name) {
+    int ino = dcache_lookup(dir_ino, name);
+    if (ino != -1)
+        return ino;
+
+    struct dfilter *filter = dfilter_get(dir_ino);
+    if (filter != NULL && !dfilter_maybe(filter, name))
+        return -1; // certainly not there
+    if (filter == NULL && dir_inode->type == IFDIR)
+        ino = dir_scan(dir_inode, name, dfilter_new(dir_ino));
+    else
+        ino = dir_findname(dir_inode, name);
+    if (ino != -1)
+        dcache_add(dir_ino, name, ino);
+    return ino;
+}
+
+/** updates the dentry cache and name filter of directory dir_ino after
+ *  name (inode ino) was added to it
+ */
+static void dir_added(int dir_ino, const char *name, int ino) {
+    struct dfilter *filter = dfilter_get(dir_ino);
+    if (filter != NULL)
+        dfilter_add(filter, name);
+    dcache_add(dir_ino, name, ino);
 }
 
 /*****************************************************/
@@ -284,14 +1025,17 @@ int get_inode(char *path_name) {
 
     while (current_dir != NULL)
     {
-        if (inode_load(curr_ino, &curr_inode) == -1)
-            return -1;
-        if (curr_inode.type != IFDIR)
-            return -1;
+        int next_ino = dcache_lookup(curr_ino, current_dir); // found: curr_ino is a dir
+        if (next_ino == -1) {
+            if (inode_load(curr_ino, &curr_inode) == -1)
+                return -1;
+            if (curr_inode.type != IFDIR)
+                return -1;
 
-        int next_ino = dir_findname(&curr_inode, current_dir);
-        if (next_ino == -1)
-            return -1;
+            next_ino = dir_lookup(curr_ino, &curr_inode, current_dir);
+            if (next_ino == -1)
+                return -1;
+        }
 
         curr_ino = next_ino;
         current_dir = strtok(NULL, "/");
@@ -345,34 +1089,34 @@ char *get_filename(char *pathname) {
  * returns 0 if success or -1 if error
  */
 static int delete_file(int ino_number, struct fs_inode *inode) {
+    // the blocks are collected and freed together at the end
+    uint16_t freed[DIRBLOCK_PER_INODE + BLOCKSZ / sizeof(uint16_t) + 1];
+    int nfreed = 0;
+
     // Free direct blocks
     for (int i = 0; i < DIRBLOCK_PER_INODE; i++)
     {
-        if (inode->dir_block[i] != 0)
+        if (inode->dir_block[i] != 0 && inode->dir_block[i] < rootSB.block_cnt)
         {
-            block_free(inode->dir_block[i]);
+            freed[nfreed++] = inode->dir_block[i];
         }
     }
     
     // Free indirect blocks
-    if (inode->indir_block != 0)
+    if (inode->indir_block != 0 && inode->indir_block < rootSB.block_cnt)
     {
         uint16_t ind_data[BLOCKSZ / sizeof(uint16_t)];
-        disk_read(inode->indir_block, (char *)ind_data);
-
-        // Calculate exact number of used indirect blocks
-        int total_blocks = (inode->size + BLOCKSZ - 1) / BLOCKSZ;
-        int indirect_count = total_blocks - DIRBLOCK_PER_INODE;
-        if (indirect_count < 0)
-            indirect_count = 0;
+        bcache_read(inode->indir_block, (char *)ind_data);
 
-        for (int k = 0; k < indirect_count && k < (BLOCKSZ / sizeof(uint16_t)); k++)
+        // all of them: blocks may be allocated ahead of the size (see dir_grow)
+        for (int k = 0; k < (BLOCKSZ / sizeof(uint16_t)); k++)
         {
-            if (ind_data[k] != 0)
-                block_free(ind_data[k]);
+            if (ind_data[k] != 0 && ind_data[k] < rootSB.block_cnt)
+                freed[nfreed++] = ind_data[k];
         }
-        block_free(inode->indir_block);
+        freed[nfreed++] = inode->indir_block;
     }
+    blocks_free(freed, nfreed);
     
     // Free the inode itself
     return inode_free(ino_number);
@@ -397,8 +1141,24 @@ static int get_entries_in_block(int dir_size, int block_index) {
     return entries_in_block;
 }
 
+/** allocates the blocks for the next (up to) want slots of a growing
+ *  directory, contiguous after goal if possible, and zeroes them;
+ *  returns the first block and how many in *got; -1 if no free blocks
+ */
+static int dir_grow(int goal, int want, int *got) {
+    union fs_block zero;
+    int first = block_alloc_run(goal, want, got);
+
+    memset(zero.data, 0, BLOCKSZ);
+    for (int i = 0; first != -1 && i < *got; i++)
+        bcache_write(first + i, zero.data); // contiguous: the cache writes them with one request
+    return first;
+}
+
 /**
  * Tries to find space in the 11 direct blocks for a new directory entry
+ * (a directory grows by as many blocks as it has, up to DIR_PREALLOC,
+ * so a big one ends up in long contiguous runs)
  * returns block number if space found, 0 if all direct blocks full, -1 on allocation error
  */
 static int try_direct_blocks(int parent_ino, struct fs_inode *parent_inode,
@@ -408,18 +1168,21 @@ static int try_direct_blocks(int parent_ino, struct fs_inode *parent_inode,
         int blknum = parent_inode->dir_block[i];
         
         if (blknum == 0) {
-            blknum = block_alloc();
+            int got, want = MAX(1, MIN(MIN(i, DIR_PREALLOC), DIRBLOCK_PER_INODE - i));
+            int goal = i > 0 ? parent_inode->dir_block[i - 1] + 1
+                             : GROUPS ? group_datastart(inode_group(parent_ino)) : 0;
+            blknum = dir_grow(goal, want, &got);
             if (blknum == -1)
                 return -1;
 
-            // Save the new block number in the inode
-            parent_inode->dir_block[i] = blknum;
+            // Save the new block numbers in the inode
+            for (int k = 0; k < got; k++)
+                parent_inode->dir_block[i + k] = blknum + k;
             inode_save(parent_ino, parent_inode);
 
             memset(block->data, 0, BLOCKSZ);
-            disk_write(blknum, block->data);
         } else {
-            disk_read(blknum, block->data);
+            bcache_read(blknum, block->data);
         }
 
         int entries_in_block = get_entries_in_block(parent_inode->size, i);
@@ -442,7 +1205,9 @@ static int try_indirect_blocks(int parent_ino, struct fs_inode *parent_inode,
     int indirect_block_num = parent_inode->indir_block;
 
     if (indirect_block_num == 0) {
-        indirect_block_num = block_alloc();
+        int got;
+        indirect_block_num = block_alloc_run(parent_inode->dir_block[DIRBLOCK_PER_INODE - 1] + 1,
+                                             1, &got);
         if (indirect_block_num == -1)
             return -1;
 
@@ -451,9 +1216,9 @@ static int try_indirect_blocks(int parent_ino, struct fs_inode *parent_inode,
         inode_save(parent_ino, parent_inode);
 
         memset(indirect_block_data, 0, BLOCKSZ);
-        disk_write(indirect_block_num, (char *)indirect_block_data);
+        bcache_write(indirect_block_num, (char *)indirect_block_data);
     } else {
-        disk_read(indirect_block_num, (char *)indirect_block_data);
+        bcache_read(indirect_block_num, (char *)indirect_block_data);
     }
 
     // loop through all possible pointers in the indirect block
@@ -461,19 +1226,21 @@ static int try_indirect_blocks(int parent_ino, struct fs_inode *parent_inode,
         int data_block_num = indirect_block_data[i];
         
         if (data_block_num == 0) {
-            data_block_num = block_alloc();
+            int got, nblocks = DIRBLOCK_PER_INODE + i;
+            int want = MIN(MIN(nblocks, DIR_PREALLOC), BLOCKSZ / sizeof(uint16_t) - i);
+            int goal = (i > 0 ? indirect_block_data[i - 1] : indirect_block_num) + 1;
+            data_block_num = dir_grow(goal, want, &got);
             if (data_block_num == -1)
                 return -1;
 
-            // Update the indirect block with the new data block number
-            indirect_block_data[i] = data_block_num;
-            disk_write(indirect_block_num, (char *)indirect_block_data);
+            // Update the indirect block with the new data block numbers
+            for (int k = 0; k < got; k++)
+                indirect_block_data[i + k] = data_block_num + k;
+            bcache_write(indirect_block_num, (char *)indirect_block_data);
 
-            // Initialize the new data block with zeros
             memset(block->data, 0, BLOCKSZ);
-            disk_write(data_block_num, block->data);
         } else {    
-            disk_read(data_block_num, block->data);
+            bcache_read(data_block_num, block->data);
         }
 
         // block index is DIRBLOCK_PER_INODE + i
@@ -517,24 +1284,26 @@ int add_entry_to_directory(int parent_ino, char *name, int child_ino) {
 
     // First, search for a FREE entry in existing blocks
     int num_entries = parent_inode.size / sizeof(struct fs_dirent);
-    int offset = 0;
+    int currBlock = 0;
+    struct dir_walk walk;
 
+    dir_walk_start(&walk, &parent_inode);
     for (int entry_idx = 0; entry_idx < num_entries; entry_idx++) {
-        offset = entry_idx * sizeof(struct fs_dirent);
-        int currBlock = offset2block(&parent_inode, offset);
-
-        if (currBlock <= 0)
-            break;
-
-        disk_read(currBlock, block.data);
         int idx_in_block = entry_idx % DIRENTS_PER_BLOCK;
+        if (idx_in_block == 0) { // next block
+            currBlock = dir_walk_block(&walk, entry_idx / DIRENTS_PER_BLOCK);
+            if (currBlock <= 0)
+                break;
+            bcache_read(currBlock, block.data);
+        }
 
         if (block.dirent[idx_in_block].d_ino == FREE) {
             // Reuse this deleted entry
             block.dirent[idx_in_block].d_ino = child_ino;
             strncpy(block.dirent[idx_in_block].d_name, name, MAXFILENAME);
             block.dirent[idx_in_block].d_name[MAXFILENAME - 1] = '\0';
-            disk_write(currBlock, block.data);
+            bcache_write(currBlock, block.data);
+            dir_added(parent_ino, name, child_ino);
             return 0;
         }
     }
@@ -550,33 +1319,38 @@ int add_entry_to_directory(int parent_ino, char *name, int child_ino) {
     block.dirent[entries_in_block].d_ino = child_ino;
     strncpy(block.dirent[entries_in_block].d_name, name, MAXFILENAME);
     block.dirent[entries_in_block].d_name[MAXFILENAME - 1] = '\0';
-    disk_write(blknum, block.data);
+    bcache_write(blknum, block.data);
 
     // Update size
     parent_inode.size += sizeof(struct fs_dirent);
     inode_save(parent_ino, &parent_inode);
+    dir_added(parent_ino, name, child_ino);
     
     return 0;
 }
 
 
-/** * Finds name in directory, marks it as FREE on disk
+/** * Finds name in directory dir_ino (described by dir_inode), marks it as FREE on disk
  * returns the inode number that was removed or -1 if not found.
  */
-int dir_remove_entry(struct fs_inode *dir_inode, char *name) {
+int dir_remove_entry(int dir_ino, struct fs_inode *dir_inode, char *name) {
     int remaining_dirents = dir_inode->size / sizeof(struct fs_dirent);
     int offset = 0;
     union fs_block block;
+    struct dir_walk walk;
+
+    dcache_remove(dir_ino, name);
 
     // Search while there are entries left to check
+    dir_walk_start(&walk, dir_inode);
     while (remaining_dirents > 0)
     {
-        int currBlock = offset2block(dir_inode, offset);
+        int currBlock = dir_walk_block(&walk, offset / BLOCKSZ);
 
         if (currBlock <= 0)
             return -1;
 
-        disk_read(currBlock, block.data);
+        bcache_read(currBlock, block.data);
 
         // Loop through entries in this block
         for (int d = 0; d < DIRENTS_PER_BLOCK && d < remaining_dirents; d++)
@@ -587,7 +1361,7 @@ int dir_remove_entry(struct fs_inode *dir_inode, char *name) {
                 int removed_ino = block.dirent[d].d_ino;
                 block.dirent[d].d_ino = FREE;
                 memset(block.dirent[d].d_name, 0, MAXFILENAME);
-                disk_write(currBlock, block.data);
+                bcache_write(currBlock, block.data);
                 return removed_ino;
             }
         }
@@ -602,7 +1376,7 @@ int dir_remove_entry(struct fs_inode *dir_inode, char *name) {
  *  dirname may start with "/" or not;
  *  dirname may be one name or a pathname with subdirectories.
  */
-int fs_ls(char *dirname) {
+static int list_dir(char *dirname) {
     int number_of_ino = get_inode(dirname);
     if (number_of_ino == -1)
     {
@@ -622,17 +1396,19 @@ int fs_ls(char *dirname) {
     int remaining_dirents = inode_of_dir.size / sizeof(struct fs_dirent);
     int offset = 0;
     union fs_block block;
+    struct dir_walk walk;
     printf("listing dir %s (inode %d):\n", dirname, number_of_ino);
     printf("ino:type:nlk    bytes name\n");
 
+    dir_walk_start(&walk, &inode_of_dir);
     while (remaining_dirents > 0)
     {
-        int currBlock = offset2block(&inode_of_dir, offset);
+        int currBlock = dir_walk_block(&walk, offset / BLOCKSZ);
 
         if (currBlock <= 0)
             return -1;
 
-        disk_read(currBlock, block.data);
+        bcache_read(currBlock, block.data); // a copy: inode_load below uses the cache
         for (int d = 0; d < DIRENTS_PER_BLOCK && d < remaining_dirents; d++)
         {
             if (block.dirent[d].d_ino != FREE)
@@ -664,7 +1440,7 @@ int fs_ls(char *dirname) {
 /** creates a new link to an existing file;
  *  returns the file inode number or -1 if error.
  */
-int fs_link(char *filename, char *newlink) {
+static int link_file(char *filename, char *newlink) {
     int file_ino = get_inode(filename);
     if (file_ino == -1)
     {
@@ -702,7 +1478,7 @@ int fs_link(char *filename, char *newlink) {
     {
         return -1; // parent has to be a directory
     }
-    else if (dir_findname(&parent_inode, newlink_name) != -1)
+    else if (dir_lookup(parent_ino, &parent_inode, newlink_name) != -1)
     {
         return -1; // newlink already exists
     }
@@ -724,7 +1500,7 @@ int fs_link(char *filename, char *newlink) {
 /** creates a new file;
  *  returns the allocated inode number or -1 if error.
  */
-int fs_create(char *filename) {
+static int create_file(char *filename) {
     char *file_name = get_filename(filename);
     if (file_name == NULL)
     {
@@ -745,11 +1521,11 @@ int fs_create(char *filename) {
     {
         return -1;
     }
-    if (dir_findname(&parent_inode, file_name) != -1)
+    if (dir_lookup(parent_ino, &parent_inode, file_name) != -1)
     {
         return -1; // file already exists
     }
-    int new_file_ino = inode_alloc();
+    int new_file_ino = inode_alloc_near(parent_ino, 0);
     if (new_file_ino == -1)
     {
         return -1;
@@ -777,7 +1553,7 @@ int fs_create(char *filename) {
 /** creates a new directory;
  *  returns the allocated inode number or -1 if error.
  */
-int fs_mkdir(char *dirname) {
+static int make_dir(char *dirname) {
     char *file_name = get_filename(dirname);
     if (file_name == NULL)
     {
@@ -802,12 +1578,12 @@ int fs_mkdir(char *dirname) {
         return -1;
     }
 
-    if (dir_findname(&parent_inode, file_name) != -1)
+    if (dir_lookup(parent_ino, &parent_inode, file_name) != -1)
     {
         return -1; // directory already exists
     }
 
-    int new_dir_ino = inode_alloc();
+    int new_dir_ino = inode_alloc_near(parent_ino, 1);
     if (new_dir_ino == -1)
     {
         return -1;
@@ -839,7 +1615,7 @@ int fs_mkdir(char *dirname) {
  *  free inode and data blocks if it is last link.
  *  returns filename inode number or -1 if error.
  */
-int fs_unlink(char *filename) {
+static int unlink_file(char *filename) {
     char *link_name = get_filename(filename);
     if (link_name == NULL)
     {
@@ -859,7 +1635,7 @@ int fs_unlink(char *filename) {
         return -1; // Parent must be a directory
 
 
-    int linked_entry_ino = dir_remove_entry(&parent_inode, link_name);
+    int linked_entry_ino = dir_remove_entry(parent_ino, &parent_inode, link_name);
 
     if (linked_entry_ino == -1)
         return -1; // File not found
@@ -898,7 +1674,7 @@ int fs_unlink(char *filename) {
 void dumpSB(int numb) {
     union fs_block block;
 
-    disk_read(numb, block.data);
+    bcache_read(numb, block.data);
     printf("Disk superblock %d:\n", numb);
     printf("    magic = %x\n", block.super.magic);
     printf("    disk size %d blocks\n", block.super.block_cnt);
@@ -909,39 +1685,56 @@ void dumpSB(int numb) {
            block.super.inode_cnt);
     printf("    first data block: %d\n", block.super.first_datablk);
     printf("    data blocks: %d\n", block.super.block_cnt - block.super.first_datablk);
+    if (block.super.group_blocks != 0)
+        printf("    block groups: %d blocks, %d of them with inodes\n",
+               block.super.group_blocks, block.super.group_inodeblks);
+    printf("    allocation rotors: block %d, inode %d\n", block.super.block_rotor,
+           block.super.inode_rotor);
+    printf("    free: %d blocks, %d inodes\n", block.super.free_blocks,
+           block.super.free_inodes);
 }
 
 /** prints information details about file system for debugging
  */
-void fs_debug() {
+static void debug_dump() {
     union fs_block block;
 
+    sb_sync(); // the SB on disk is the one in use
     dumpSB(SBLOCK);
     if (check_rootSB() == -1) return;
+    icache_sync();
 
-    disk_read(SBLOCK, block.data);
+    bcache_read(SBLOCK, block.data);
     rootSB = block.super;
+    // the inode table is read whole, with a single disk request per group
+    union fs_block *buf = malloc(group_inodeblks() * BLOCKSZ);
+    if (buf == NULL) return;
+    const union fs_block *blocks;
+
     printf("**************************************\n");
-    printf("blocks in use - bitmap:\n");
+    printf("blocks in use - bitmap (%u of %d):\n",
+           bitmap_count(bmap, rootSB.block_cnt), rootSB.block_cnt);
     int nblocks = rootSB.block_cnt;
     for (int i = 0; i < rootSB.bmap_size; i++) {
-        disk_read(BITMAPSTART + i, block.data);
-        bitmap_print(block.data, MIN(BLOCKSZ*8, nblocks));
-        nblocks -= BLOCKSZ * 8;
+        bitmap_print(bmap + i * bmap_bits() / 8, MIN(bmap_bits(), nblocks));
+        nblocks -= bmap_bits();
     }
     printf("**************************************\n");
     printf("inodes in use:\n");
-    for (int i = 0; i < rootSB.inode_blocks; i++) {
-        disk_read(INODESTART + i, block.data);
-        for (int j = 0; j < INODES_PER_BLOCK; j++)
-            if (block.inode[j].type != IFFREE) {
-                printf(" %d:type=%d;size=%d;nlinks=%d\n",
-                    j + i * INODES_PER_BLOCK,
-                    block.inode[j].type, block.inode[j].size,
-                    block.inode[j].nlinks);
-            }
+    for (int g = 0; g < ngroups(); g++) {
+        blocks = blocks_view(group_inodestart(g), group_inodeblks(), buf);
+        for (int i = 0; i < group_inodeblks(); i++) {
+            for (int j = 0; j < INODES_PER_BLOCK; j++)
+                if (blocks[i].inode[j].type != IFFREE) {
+                    printf(" %d:type=%d;size=%d;nlinks=%d\n",
+                        j + (g * group_inodeblks() + i) * INODES_PER_BLOCK,
+                        blocks[i].inode[j].type, blocks[i].inode[j].size,
+                        blocks[i].inode[j].nlinks);
+                }
+        }
     }
     printf("**************************************\n");
+    free(buf);
 }
 
 
@@ -950,8 +1743,7 @@ void fs_debug() {
 /** format the disk = initialize the disk with the FS structures;
  *   rootSB is also initialized for this FS (mounted)
  */
-int fs_format() {
-    union fs_block freebitmap;
+static int format_disk() {
     int nblocks, root_inode;
 
     if (check_rootSB() == 0) {
@@ -961,40 +1753,94 @@ int fs_format() {
     nblocks = disk_size();
 
     // disk must be at least 4 blocks size...
+    if (nblocks < 4) {
+        printf("No disk to format!\n");
+        return -1;
+    }
     memset(&rootSB, 0, sizeof(rootSB)); // empty rootSB
     rootSB.magic = FS_MAGIC;
     rootSB.block_cnt = nblocks; // disk size in blocks
     rootSB.block_size = BLOCKSZ;
 
-    // bitmap needs 1 bit per block (in a disk block there are 8*BLOCKSZ bits)
-    // number of blocks needed for nblocks' bitmap (rounded up):
-    rootSB.bmap_size = nblocks / (8 * BLOCKSZ) + (nblocks % (8 * BLOCKSZ) != 0);
+    if (format_groups > 0) {
+        // whole bytes of the bitmap, that fit in the group's bitmap block
+        int group = MIN(MAX(format_groups / 8 * 8, 64), 8 * BLOCKSZ);
+        int inodes = (group + 3) / 4; // same ratio as below, in each group
+        int inodeblks = inodes / INODES_PER_BLOCK + (inodes % INODES_PER_BLOCK != 0);
+        // a shorter last group, if it has room for some data
+        int groups = nblocks / group + (nblocks % group >= 3 + inodeblks);
+        if (groups > 0) {
+            rootSB.group_blocks = group;
+            rootSB.group_inodeblks = inodeblks;
+            rootSB.bmap_size = groups;
+            rootSB.first_inodeblk = 2;
+            rootSB.inode_blocks = groups * inodeblks;
+            rootSB.inode_cnt = rootSB.inode_blocks * INODES_PER_BLOCK;
+            rootSB.first_datablk = rootSB.first_inodeblk + inodeblks;
+        }
+    }
+    if (!GROUPS) {
+        // bitmap needs 1 bit per block (in a disk block there are 8*BLOCKSZ bits)
+        // number of blocks needed for nblocks' bitmap (rounded up):
+        rootSB.bmap_size = nblocks / (8 * BLOCKSZ) + (nblocks % (8 * BLOCKSZ) != 0);
 
-    rootSB.first_inodeblk = 1 + rootSB.bmap_size;
+        rootSB.first_inodeblk = 1 + rootSB.bmap_size;
 
-    int inodes = (nblocks + 3) / 4; // number of inodes at least 1/4 the number of blocks
-    assert(inodes>0); // at least 1 inode
-    rootSB.inode_blocks = inodes / INODES_PER_BLOCK + (inodes % INODES_PER_BLOCK != 0); // round up
-    rootSB.inode_cnt = rootSB.inode_blocks * INODES_PER_BLOCK;
+        int inodes = (nblocks + 3) / 4; // number of inodes at least 1/4 the number of blocks
+        assert(inodes>0); // at least 1 inode
+        rootSB.inode_blocks = inodes / INODES_PER_BLOCK + (inodes % INODES_PER_BLOCK != 0); // round up
+        rootSB.inode_cnt = rootSB.inode_blocks * INODES_PER_BLOCK;
 
-    rootSB.first_datablk = rootSB.first_inodeblk + rootSB.inode_blocks;
+        rootSB.first_datablk = rootSB.first_inodeblk + rootSB.inode_blocks;
+    }
+    rootSB.block_rotor = rootSB.first_datablk;
+    sb_dirty = 0;
+
+    disk_set_regions(BITMAPSTART, rootSB.first_inodeblk, rootSB.first_datablk);
+    disk_set_groups(rootSB.group_blocks);
+    icache_create();
+    dcache_clear();
+    dfilter_clear();
+
+    /* buffer for the bitmap and inodes table blocks of a group; the inodes
+     * part is never written to, so it stays zeros for every group */
+    int nbmap = GROUPS ? 1 : rootSB.bmap_size;
+    union fs_block *meta = calloc(nbmap + group_inodeblks(), BLOCKSZ);
+    if (meta == NULL || bmap_create() == -1) {
+        free(meta);
+        bmap_destroy();
+        memset(&rootSB, 0, sizeof(rootSB)); // not formated
+        return -1;
+    }
+    for (int g = 0; g < ngroups(); g++) // the superblock (copy), bitmap and inodes
+        bitmap_set_range(bmap, g * rootSB.group_blocks, group_datastart(g) - g * rootSB.group_blocks);
+    rootSB.free_blocks = rootSB.block_cnt - bitmap_count(bmap, rootSB.block_cnt);
+    rootSB.free_inodes = rootSB.inode_cnt; // the root dir is next
 
     /* update superblock in disk (block 0)*/
-    disk_write(SBLOCK, (char*)&rootSB);
+    union fs_block sb = { .super = rootSB }; // the rest of the block is zeros
+    bcache_write(SBLOCK, sb.data);
     dumpSB(SBLOCK); // print what is now stored on the disk
 
-    /* initialize bitmap blocks */
-    memset(&freebitmap, 0, sizeof(freebitmap));
-    for (int i = 0; i < rootSB.first_datablk; i++)
-        bitmap_set(freebitmap.data, i);
-    disk_write(BITMAPSTART, freebitmap.data);
-    memset(&freebitmap, 0, sizeof(freebitmap));
-    for (int i = 1; i < rootSB.bmap_size; i++)
-        disk_write(BITMAPSTART + i, freebitmap.data);
-
-    /* initialize inodes table blocks */
-    for (int i = 0; i < rootSB.inode_blocks; i++)
-        disk_write(INODESTART + i, freebitmap.data);
+    for (int g = 0; g < ngroups(); g++) {
+        int end = GROUPS ? MIN((g + 1) * rootSB.group_blocks, nblocks) : nblocks;
+        if (g > 0)
+            bcache_write(g * rootSB.group_blocks, sb.data); // a copy of the superblock
+
+        /* release the data area, and the inodes table if the device can make
+         * it read as zeros (no need to write it then) */
+        if (group_datastart(g) < end)
+            bcache_discard(group_datastart(g), end - group_datastart(g));
+        int zeroed = bcache_discard(group_inodestart(g), group_inodeblks()) == 0;
+
+        /* initialize bitmap and inodes table blocks (they are contiguous,
+         * so a single disk request writes them all) */
+        int metablocks = nbmap + (zeroed ? 0 : group_inodeblks());
+        for (int i = 0; i < nbmap; i++)
+            bmap_getblock(g + i, &meta[i]);
+        bcache_writev(bmap_block(g), metablocks, meta[0].data);
+    }
+    free(meta);
 
     /* create root dir */
     root_inode = inode_alloc();
@@ -1011,6 +1857,8 @@ int fs_format() {
     return 0;
 }
 
+static void flusher_start();
+
 /** mount root FS;
  *  open device image or create it;
  *  loads superblock from device into global variable rootSB;
@@ -1019,18 +1867,302 @@ int fs_format() {
 int fs_mount(char *device, int size) {
     union fs_block block;
 
+    disk_set_tag(FS_OP_MOUNT);
     if (rootSB.magic == FS_MAGIC) {
         printf("A disc is already mounted!\n");
         return -1;
     }
     if (disk_init(device, size) < 0) return -1; // open disk image or create if it does not exist
-    disk_read(SBLOCK, block.data);
+    disk_set_regions(BITMAPSTART, BITMAPSTART, BITMAPSTART); // only the superblock is known yet
+    disk_set_groups(0);
+    bcache_read(SBLOCK, block.data);
     if (block.super.magic != FS_MAGIC) {
         printf("Unformatted disc! Not mounted.\n");
         return -1;
     }
     rootSB = block.super;
+    // the rotors are only hints: older FSs leave garbage there
+    if (rootSB.block_rotor < rootSB.first_datablk || rootSB.block_rotor >= rootSB.block_cnt)
+        rootSB.block_rotor = rootSB.first_datablk;
+    if (rootSB.inode_rotor >= rootSB.inode_cnt)
+        rootSB.inode_rotor = 0;
+    sb_dirty = 0;
+    if (GROUPS && (rootSB.group_blocks % 8 != 0 || rootSB.group_blocks > 8 * BLOCKSZ
+                   || rootSB.group_inodeblks == 0
+                   || 2 + rootSB.group_inodeblks >= rootSB.group_blocks // no room for data
+                   || rootSB.group_inodeblks * ngroups() != rootSB.inode_blocks
+                   || rootSB.bmap_size != ngroups())) {
+        printf("Bad block groups in the superblock! Not mounted.\n");
+        memset(&rootSB, 0, sizeof(rootSB));
+        return -1;
+    }
+    disk_set_regions(BITMAPSTART, rootSB.first_inodeblk, rootSB.first_datablk);
+    disk_set_groups(rootSB.group_blocks);
+    icache_create();
+    dcache_clear();
+    dfilter_clear();
+    if (bmap_load() == -1) {
+        printf("Out of memory for the bitmap! Not mounted.\n");
+        memset(&rootSB, 0, sizeof(rootSB));
+        return -1;
+    }
+    // the free counts are checked against the bitmaps (older FSs have garbage there)
+    int free_blocks = rootSB.block_cnt - bitmap_count(bmap, rootSB.block_cnt);
+    int free_inodes = rootSB.inode_cnt - bitmap_count(imap, rootSB.inode_cnt);
+    if (rootSB.free_blocks != free_blocks || rootSB.free_inodes != free_inodes) {
+        rootSB.free_blocks = free_blocks;
+        rootSB.free_inodes = free_inodes;
+        sb_dirty = 1;
+    }
+    flusher_start();
     return 0;
 }
 
+/*****************************************************/
+
+/*******
+ * Sync and the background flusher. The public operations below hold
+ * fslock, so the flusher thread never writes in the middle of one. Every
+ * operation that may change the FS starts the dirty period (dirty_since);
+ * the flusher syncs when that is older than flush_age_ms, or as soon as
+ * the dirty blocks and inodes in memory reach flush_dirty_max.
+ */
+
+static pthread_mutex_t fslock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flush_age_ms = 0;          // 0: no flusher
+static int flush_dirty_max = 0;
+static long long dirty_since = 0;     // ms time of the first change not synced (0: none)
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/** returns how many blocks and inodes in memory are waiting to be written
+ */
+static int dirty_count() {
+    int n = bcache_stats().dirty;
+    for (int i = 0; i < icache_n; i++)
+        n += icache[i].dirty;
+    return n + sb_dirty + bitmap_count(bmap_dirty, rootSB.bmap_size);
+}
+
+/** writes to disk everything the FS keeps in memory: the dirty cached
+ *  inodes, the superblock, the changed bitmap blocks and then all dirty
+ *  cached blocks
+ */
+static void sync_all() {
+    icache_sync();
+    sb_sync();
+    bmap_sync();
+    bcache_flush();
+    dirty_since = 0;
+}
+
+static void *flusher_main(void *arg) {
+    int period_ms = MAX(flush_age_ms / 4, 10);
+
+    pthread_mutex_lock(&fslock);
+    while (flusher_running) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += period_ms / 1000;
+        until.tv_nsec += (period_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusher_cond, &fslock, &until);
+        if (flusher_running && dirty_since != 0
+            && (now_ms() - dirty_since >= flush_age_ms || dirty_count() >= flush_dirty_max)) {
+            disk_set_tag(FS_OP_SYNC);
+            sync_all();
+        }
+    }
+    pthread_mutex_unlock(&fslock);
+    return NULL;
+}
+
+/** starts the flusher thread for the mounted FS, if one was asked for
+ */
+static void flusher_start() {
+    if (flush_age_ms <= 0 || flusher_running)
+        return;
+    flusher_running = 1;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0)
+        flusher_running = 0; // it still works, with explicit syncs only
+}
+
+static void flusher_stop() {
+    pthread_mutex_lock(&fslock);
+    int running = flusher_running;
+    flusher_running = 0;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&fslock);
+    if (running)
+        pthread_join(flusher, NULL);
+}
+
+/** sets the background flusher of the next mount: it syncs when the
+ *  oldest change not on disk is age_ms old, or when dirty_max blocks and
+ *  inodes are waiting; age_ms == 0 disables it (only explicit syncs)
+ */
+void fs_set_flusher(int age_ms, int dirty_max) {
+    flush_age_ms = age_ms;
+    flush_dirty_max = dirty_max;
+}
+
+/** starts an operation tagged op;
+ *  returns -1 if no disk is mounted (see check_rootSB); 0 if it's OK
+ */
+static int op_begin(enum fs_op op) {
+    pthread_mutex_lock(&fslock);
+    disk_set_tag(op);
+    return rootSB.magic == FS_MAGIC ? 0 : -1;
+}
+
+/** ends an operation; changed tells if it may have changed the FS
+ */
+static void op_end(int changed) {
+    if (changed && rootSB.magic == FS_MAGIC) {
+        if (dirty_since == 0)
+            dirty_since = now_ms();
+        if (flusher_running && dirty_count() >= flush_dirty_max)
+            pthread_cond_signal(&flusher_cond);
+    }
+    pthread_mutex_unlock(&fslock);
+}
+
+/** sets the layout of the next format: groups of group_blocks blocks
+ *  (a multiple of 8, 64 to 8 * the block size), each with its own bitmap
+ *  and inode table slice; 0 (the default) for a single bitmap and inode
+ *  table at the start of the disk
+ */
+void fs_set_groups(int group_blocks) {
+    format_groups = group_blocks;
+}
+
+/** writes to disk everything the FS keeps in memory (the bitmap, the
+ *  dirty cached inodes and blocks); returns -1 if no disk is mounted
+ */
+int fs_sync() {
+    int r = op_begin(FS_OP_SYNC);
+    if (r == 0)
+        sync_all();
+    op_end(0);
+    return r;
+}
+
+/** copies the block cache statistics into st (if not NULL) and clears
+ *  them if reset, holding fslock so that the flusher is not writing back
+ */
+void fs_cache_stats(struct bcache_stats *st, int reset) {
+    pthread_mutex_lock(&fslock);
+    if (st != NULL)
+        *st = bcache_stats();
+    if (reset)
+        bcache_stats_reset();
+    pthread_mutex_unlock(&fslock);
+}
+
+/** unmounts the FS: stops the flusher, syncs, forgets everything cached
+ *  and closes the disk; returns -1 if no disk is mounted
+ */
+int fs_unmount() {
+    flusher_stop();
+    int r = op_begin(FS_OP_UNMOUNT);
+    if (r == 0) {
+        sync_all();
+        bcache_invalidate();
+        icache_destroy();
+        dcache_clear();
+        dfilter_clear();
+        bmap_destroy();
+        memset(&rootSB, 0, sizeof(rootSB));
+        disk_close();
+    }
+    op_end(0);
+    return r;
+}
 
+/*****************************************************/
+
+/*** Public operations ***/
+
+/** prints the FS details for debugging (see debug_dump)
+ */
+void fs_debug() {
+    op_begin(FS_OP_DEBUG); // debug_dump tells if not mounted
+    debug_dump();
+    op_end(0);
+}
+
+/** formats the disk (see format_disk); the new FS is mounted
+ */
+int fs_format() {
+    op_begin(FS_OP_FORMAT); // needs an unmounted FS
+    int r = format_disk();
+    op_end(1);
+    if (r == 0)
+        flusher_start();
+    return r;
+}
+
+/** lists directory dirname (see list_dir)
+ */
+int fs_ls(char *dirname) {
+    int r = op_begin(FS_OP_LS) == 0 ? list_dir(dirname) : -1;
+    op_end(0);
+    return r;
+}
+
+/** creates file filename (see create_file)
+ */
+int fs_create(char *filename) {
+    int r = op_begin(FS_OP_CREATE) == 0 ? create_file(filename) : -1;
+    op_end(1);
+    return r;
+}
+
+/** creates directory dirname (see make_dir)
+ */
+int fs_mkdir(char *dirname) {
+    int r = op_begin(FS_OP_MKDIR) == 0 ? make_dir(dirname) : -1;
+    op_end(1);
+    return r;
+}
+
+/** removes the link filename (see unlink_file)
+ */
+int fs_unlink(char *filename) {
+    int r = op_begin(FS_OP_UNLINK) == 0 ? unlink_file(filename) : -1;
+    op_end(1);
+    return r;
+}
+
+/** links newlink to filename (see link_file)
+ */
+int fs_link(char *filename, char *newlink) {
+    int r = op_begin(FS_OP_LINK) == 0 ? link_file(filename, newlink) : -1;
+    op_end(1);
+    return r;
+}
+
+/** fills df with the size and free space of the mounted FS, from the
+ *  counts kept in the superblock; returns -1 if no disk is mounted
+ */
+int fs_df(struct fs_df *df) {
+    int r = op_begin(FS_OP_DF);
+    if (r == 0) {
+        df->blocks = rootSB.block_cnt;
+        df->free_blocks = rootSB.free_blocks;
+        df->inodes = rootSB.inode_cnt;
+        df->free_inodes = rootSB.free_inodes;
+    }
+    op_end(0);
+    return r;
+}
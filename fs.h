@@ -1,9 +1,40 @@
 #ifndef FS_H
 #define FS_H
 
+// file system operations, as tagged in disk traces (see disk_set_tag)
+enum fs_op {
+    FS_OP_NONE = 0,
+    FS_OP_MOUNT,
+    FS_OP_FORMAT,
+    FS_OP_DEBUG,
+    FS_OP_LS,
+    FS_OP_CREATE,
+    FS_OP_MKDIR,
+    FS_OP_UNLINK,
+    FS_OP_LINK,
+    FS_OP_SYNC,
+    FS_OP_UNMOUNT,
+    FS_OP_DF
+};
+
+// size and free space of the mounted FS (see fs_df)
+struct fs_df {
+    int blocks, free_blocks;
+    int inodes, free_inodes;
+};
+
+struct bcache_stats;  // see cache.h
+
 void fs_debug();
 int  fs_format();
 int  fs_mount(char *device, int size);
+int  fs_sync();
+void fs_cache_stats(struct bcache_stats *st, int reset);
+int  fs_df(struct fs_df *df);
+int  fs_unmount();
+void fs_set_flusher(int age_ms, int dirty_max);
+void fs_set_icache(int bytes);
+void fs_set_groups(int group_blocks);
 int  fs_ls(char *dirname);
 int  fs_create( char *filename );
 int  fs_mkdir( char *dirname );
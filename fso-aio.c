@@ -0,0 +1,118 @@
+/*
+ ============================================================================
+ Name        : fso-aio.c
+ Description : checks the asynchronous disk requests: writes a pattern to
+               a range of blocks with disk_submit_write, reads it back with
+               disk_submit_read, and compares the data
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+
+#define NREQS 100   // requests of each kind (more than the queue depth)
+
+
+/** fills data with a pattern that only block blocknum has
+ */
+static void pattern(unsigned blocknum, char *data) {
+    for (int i = 0; i < DISK_BLOCK_SIZE; i++)
+        data[i] = (char)(blocknum * 31 + i);
+}
+
+/** submits a request for each block, from start, to or from its buffer in
+ *  bufs; when the queue is full, reaps a request (alternating disk_poll and
+ *  disk_wait); then waits for all of them; returns the number reaped
+ */
+static int run(int write, unsigned start, char *bufs[]) {
+    int reaped = 0;
+
+    for (int i = 0; i < NREQS; i++) {
+        int id;
+        while ((id = write ? disk_submit_write(start + i, bufs[i])
+                           : disk_submit_read(start + i, bufs[i])) == -1) {
+            if ((i % 2 == 0 && disk_poll() != -1) || disk_wait(-1) != -1)
+                reaped++;
+            else
+                return -1; // queue full, but nothing to reap
+        }
+        if (i % 10 == 0 && disk_wait(id) == id) // some are waited for by id
+            reaped++;
+    }
+    while (disk_wait(-1) != -1)
+        reaped++;
+    return reaped;
+}
+
+/** prints how to use this program
+ */
+static void usage(char *prog) {
+    printf("use: %s [-b backend] diskfile\n", prog);
+    printf("    -b  disk backend to check (default stdio)\n");
+    printf("note: writes destroy the contents of the first %d blocks of diskfile\n", NREQS + 1);
+}
+
+/**
+ * MAIN
+ * returns EXIT_SUCCESS if every block read back holds what was written
+ */
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    const char *name = "stdio";
+
+    if (argc > 2 && !strcmp(argv[1], "-b")) {
+        name = argv[2];
+        if (disk_set_backend(disk_backend_byname(name)) < 0) {
+            printf("unknown disk backend: %s\n", name);
+            return 1;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2) {
+        usage(prog);
+        return 1;
+    }
+    if (disk_init(argv[1], NREQS + 1) < 0) {
+        printf("unable to initialize %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    if (disk_size() < NREQS + 1) {
+        printf("%s has %u blocks, %d are needed\n", argv[1], disk_size(), NREQS + 1);
+        disk_close();
+        return 1;
+    }
+
+    char *out = malloc(NREQS * DISK_BLOCK_SIZE), *in = calloc(NREQS, DISK_BLOCK_SIZE);
+    char *outs[NREQS], *ins[NREQS];
+    if (out == NULL || in == NULL) {
+        printf("out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < NREQS; i++) {
+        outs[i] = out + i * DISK_BLOCK_SIZE;
+        ins[i] = in + i * DISK_BLOCK_SIZE;
+        pattern(1 + i, outs[i]);
+    }
+
+    int bad = 0;
+    int written = run(1, 1, outs); // block 0 is left alone
+    int read = run(0, 1, ins);
+    for (int i = 0; i < NREQS; i++)
+        if (memcmp(outs[i], ins[i], DISK_BLOCK_SIZE) != 0) {
+            printf("block %d: read back other data\n", 1 + i);
+            bad++;
+        }
+    struct disk_stats st = disk_stats();
+    printf("%s: %d writes and %d reads reaped, %d blocks differ (%lu written, %lu read)\n",
+           name, written, read, bad, st.writes, st.reads);
+
+    free(out);
+    free(in);
+    disk_close();
+    return written == NREQS && read == NREQS && bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,169 @@
+/*
+ ============================================================================
+ Name        : fso-bench.c
+ Description : block cache benchmark: runs a mixed workload of hot directory
+               lookups and metadata scans on disk images and reports the
+               cache hit rate of each replacement policy
+ ============================================================================
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+
+#define ROUNDS  100   // default rounds of the workload
+#define LOOKUPS 8     // hot lookups per round (then one scan)
+
+// hot directories (looked up all the time) and scans (touch everything once)
+static char *hot[] = { "/", "/dir1", "/dir1/dir1.1" };
+static char *scans[] = { NULL /* fs_debug */, "/d-big" };
+
+#define NHOT   (sizeof(hot) / sizeof(hot[0]))
+#define NSCANS (sizeof(scans) / sizeof(scans[0]))
+
+static const struct {
+    const char *name;
+    enum bcache_policy policy;
+} policies[] = {
+    { "lru", BCACHE_LRU }, { "clock", BCACHE_CLOCK }, { "2q", BCACHE_2Q }
+};
+
+// cache hits and misses of one kind of operation
+struct hits {
+    unsigned long hits, misses;
+};
+
+static int saved_out = -1, saved_err = -1;
+
+/** sends stdout and stderr to /dev/null (the FS prints a lot), or back
+ */
+static void quiet(int on) {
+    fflush(stdout);
+    fflush(stderr);
+    if (on) {
+        int null = open("/dev/null", O_WRONLY);
+        saved_out = dup(1);
+        saved_err = dup(2);
+        dup2(null, 1);
+        dup2(null, 2);
+        close(null);
+    } else {
+        dup2(saved_out, 1);
+        dup2(saved_err, 2);
+        close(saved_out);
+        close(saved_err);
+    }
+}
+
+/** adds to h the cache hits and misses since the last call
+ */
+static void count(struct hits *h) {
+    struct bcache_stats st = bcache_stats();
+    h->hits += st.hits;
+    h->misses += st.misses;
+    bcache_stats_reset();
+}
+
+/** runs the workload on diskfile with the given cache, counting the cache
+ *  hits of the lookups and of the scans; returns -1 if it could not mount
+ */
+static int run(char *diskfile, int cache_blocks, enum bcache_policy policy, int rounds,
+               struct hits *lookups, struct hits *scanned) {
+    int r = -1;
+
+    memset(lookups, 0, sizeof(*lookups));
+    memset(scanned, 0, sizeof(*scanned));
+    bcache_init(cache_blocks, policy);
+    quiet(1);
+    if (fs_mount(diskfile, 0) == 0) {
+        bcache_stats_reset();
+        for (r = 0; r < rounds; r++) {
+            for (int i = 0; i < LOOKUPS; i++)
+                fs_ls(hot[i % NHOT]);
+            count(lookups);
+            char *scan = scans[r % NSCANS];
+            if (scan == NULL)
+                fs_debug();
+            else
+                fs_ls(scan);
+            count(scanned);
+        }
+        fs_unmount();
+    } else
+        disk_close();
+    quiet(0);
+    bcache_close();
+    return r;
+}
+
+static double rate(struct hits h) {
+    return h.hits + h.misses > 0 ? 100.0 * h.hits / (h.hits + h.misses) : 0.0;
+}
+
+/** prints how to use this program
+ */
+static void usage(char *prog) {
+    printf("use: %s [-c cache_blocks] [-r rounds] diskfile...\n", prog);
+    printf("    -c  only this cache size (default: 4, 8 and 16 blocks)\n");
+    printf("    -r  rounds of the workload (default %d)\n", ROUNDS);
+    printf("note: the images are used on the ram backend, they are not changed\n");
+}
+
+/**
+ * MAIN
+ * runs the workload with each cache size and policy on each disk image
+ */
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    int sizes[] = { 4, 8, 16 };
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    int rounds = ROUNDS;
+
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-c")) {
+            sizes[0] = atoi(argv[2]);
+            nsizes = 1;
+        } else if (!strcmp(argv[1], "-r"))
+            rounds = atoi(argv[2]);
+        else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc < 2 || argv[1][0] == '-' || sizes[0] <= 0 || rounds <= 0) {
+        usage(prog);
+        return 1;
+    }
+
+    disk_set_backend(&disk_ram);  // never writes back to the image
+    fs_set_icache(0);             // inodes are read through the block cache too
+
+    printf("workload: %d rounds of %d lookups (ls of", rounds, LOOKUPS);
+    for (int i = 0; i < NHOT; i++)
+        printf(" %s", hot[i]);
+    printf(") and 1 scan (debug or ls %s)\n", scans[1]);
+    printf("%-12s %6s %-6s %14s %14s %14s\n", "", "", "", "lookups", "scans", "all");
+    printf("%-12s %6s %-6s %7s %6s %7s %6s %7s %6s\n", "disk", "cache", "policy",
+           "misses", "hits", "misses", "hits", "misses", "hits");
+    for (int d = 1; d < argc; d++)
+        for (int s = 0; s < nsizes; s++)
+            for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+                struct hits lookups, scanned;
+                if (run(argv[d], sizes[s], policies[p].policy, rounds, &lookups, &scanned) < 0) {
+                    printf("%-12s unable to mount\n", argv[d]);
+                    break;
+                }
+                struct hits all = { lookups.hits + scanned.hits, lookups.misses + scanned.misses };
+                printf("%-12s %6d %-6s %7lu %5.1f%% %7lu %5.1f%% %7lu %5.1f%%\n",
+                       argv[d], sizes[s], policies[p].name,
+                       lookups.misses, rate(lookups), scanned.misses, rate(scanned),
+                       all.misses, rate(all));
+            }
+    return EXIT_SUCCESS;
+}
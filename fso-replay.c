@@ -0,0 +1,137 @@
+/*
+ ============================================================================
+ Name        : fso-replay.c
+ Description : replays a disk I/O trace (recorded with fso-sh -t) against
+               any disk backend, at full speed or at the recorded pacing
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+
+
+/** sleeps until ns nanoseconds have passed since start
+ */
+static void wait_until(const struct timespec *start, uint64_t ns) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - start->tv_sec) * 1000000000LL
+                        + (now.tv_nsec - start->tv_nsec);
+    if (elapsed < (long long)ns) {
+        long long left = ns - elapsed;
+        struct timespec ts = { left / 1000000000LL, left % 1000000000LL };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/** prints how to use this program
+ */
+static void usage(char *prog) {
+    printf("use: %s [-b backend] [-r] [-s] tracefile diskfile\n", prog);
+    printf("    -b  disk backend to replay on (default stdio)\n");
+    printf("    -r  keep the recorded pacing (default: full speed)\n");
+    printf("    -s  simulate a hard disk's timing\n");
+    printf("note: writes destroy the contents of diskfile\n");
+}
+
+/**
+ * MAIN
+ * replays every record of the trace and prints the disk statistics
+ */
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    int paced = 0;
+    struct disk_model hdd = DISK_MODEL_HDD;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-b") && argc > 2) {
+            if (disk_set_backend(disk_backend_byname(argv[2])) < 0) {
+                printf("unknown disk backend: %s\n", argv[2]);
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-r")) {
+            paced = 1;
+            argv++;
+            argc--;
+        } else if (!strcmp(argv[1], "-s")) {
+            disk_set_model(&hdd);
+            argv++;
+            argc--;
+        } else
+            break;
+    }
+    if (argc != 3) {
+        usage(prog);
+        return 1;
+    }
+
+    FILE *trace = fopen(argv[1], "r");
+    struct disk_trace_hdr hdr;
+    if (trace == NULL || fread(&hdr, sizeof(hdr), 1, trace) != 1
+        || hdr.magic != DISK_TRACE_MAGIC) {
+        printf("%s is not a disk trace\n", argv[1]);
+        return 1;
+    }
+    disk_set_discard(1); // replay the trace's discards too
+    if (disk_init(argv[2], hdr.nblocks) < 0) {
+        printf("unable to initialize %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    if (disk_size() < hdr.nblocks) {
+        printf("%s has %u blocks, the trace needs %u\n", argv[2], disk_size(), hdr.nblocks);
+        disk_close();
+        return 1;
+    }
+
+    struct disk_trace_rec rec;
+    char *buf = NULL;
+    unsigned bufblocks = 0;
+    unsigned long nrecs = 0;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+        if (rec.count > bufblocks) { // the data is not traced: any buffer will do
+            free(buf);
+            bufblocks = rec.count;
+            buf = calloc(bufblocks, DISK_BLOCK_SIZE);
+            if (buf == NULL) {
+                printf("out of memory\n");
+                return 1;
+            }
+        }
+        if (paced)
+            wait_until(&start, rec.time_ns);
+        disk_set_tag(rec.tag);
+        if (rec.op == DISK_TRACE_READ)
+            disk_readv(rec.block, rec.count, buf);
+        else if (rec.op == DISK_TRACE_WRITE)
+            disk_writev(rec.block, rec.count, buf);
+        else
+            disk_discard(rec.block, rec.count);
+        nrecs++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(trace);
+
+    struct disk_stats st = disk_stats();
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("replayed %lu requests in %.3f s\n", nrecs, secs);
+    printf("disk reads:  %lu blocks (%lu bytes) in %lu requests\n",
+           st.reads, st.read_bytes, st.read_reqs);
+    printf("disk writes: %lu blocks (%lu bytes) in %lu requests\n",
+           st.writes, st.write_bytes, st.write_reqs);
+    if (st.vtime_us > 0)
+        printf("simulated disk time: %.1f ms (%lu seeks)\n", st.vtime_us / 1000, st.seeks);
+
+    free(buf);
+    disk_close();
+    return EXIT_SUCCESS;
+}
@@ -15,6 +15,10 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+
+#define CACHE_BLOCKS 256   // default block cache size
+#define FLUSH_MS     1000  // default age of cached changes before they are written
 
 
 
@@ -23,16 +27,53 @@
 void print_help() {
     printf("Commands:\n");
     printf("    debug\n");
+    printf("    df\n");
+    printf("    format [<group_blocks>]\n");
     printf("    ls [<dirname>]\n");
     printf("    create <filename>\n");
     printf("    rm <filename>\n");
     printf("    ln <filename> <newname>\n");
     printf("    mkdir  <dirname>\n");
+    printf("    stats [reset]\n");
+    printf("    sync\n");
+    printf("    umount\n");
     printf("    help or ?\n");
     printf("    quit or exit\n");
 }
 
 
+/** prints the disk I/O statistics: totals, per region and latency histograms
+*/
+void print_stats() {
+    static const char *regions[DISK_NREGIONS] = { "super", "bitmap", "inodes", "data" };
+    struct disk_stats st = disk_stats();
+    struct bcache_stats cs;
+
+    fs_cache_stats(&cs, 0); // the flusher may be writing back
+
+    printf("disk reads:  %lu blocks (%lu bytes) in %lu requests\n",
+           st.reads, st.read_bytes, st.read_reqs);
+    printf("disk writes: %lu blocks (%lu bytes) in %lu requests\n",
+           st.writes, st.write_bytes, st.write_reqs);
+    if (st.discards > 0)
+        printf("disk discards: %lu blocks\n", st.discards);
+    printf("region      reads   writes\n");
+    for (int r = 0; r < DISK_NREGIONS; r++)
+        printf("%-8s %8lu %8lu\n", regions[r], st.region[r].reads, st.region[r].writes);
+    if (st.vtime_us > 0)
+        printf("simulated disk time: %.1f ms (%lu seeks)\n", st.vtime_us / 1000, st.seeks);
+    if (cs.size > 0)
+        printf("cache: %d blocks (%d dirty), %lu hits, %lu misses, %lu read ahead, %lu evictions, %lu writebacks\n",
+               cs.size, cs.dirty, cs.hits, cs.misses, cs.readahead, cs.evictions, cs.writebacks);
+    printf("latency(us)   reads   writes\n");
+    for (int b = 0; b < DISK_LAT_BUCKETS; b++) {
+        if (st.read_lat[b] == 0 && st.write_lat[b] == 0)
+            continue;
+        printf("<%-9lu %8lu %8lu\n", 2UL << b, st.read_lat[b], st.write_lat[b]);
+    }
+}
+
+
 /**
  * MAIN
  * just a shell to browse and test our file system implementation
@@ -43,10 +84,76 @@ int main(int argc, char *argv[]) {
     char arg1[1024];
     char arg2[1024];
     int inumber, args, nblocks;
+    char *prog = argv[0];
+    struct disk_model hdd = DISK_MODEL_HDD;
+    int simulate = 0;
+    char *tracefile = NULL;
+    int cache_blocks = CACHE_BLOCKS;
+    enum bcache_policy cache_policy = BCACHE_LRU;
+    int flush_age = FLUSH_MS;
 
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-b")) { // select disk backend
+            if (disk_set_backend(disk_backend_byname(argv[2])) < 0) {
+                printf("unknown disk backend: %s (use", argv[2]);
+                for (int i = 0; disk_backends[i] != NULL; i++)
+                    printf(" %s", disk_backends[i]->name);
+                printf(")\n");
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-c")) { // block cache size (0: no cache)
+            cache_blocks = atoi(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-f")) { // background flusher: max age of dirty data (ms, 0: none)
+            flush_age = atoi(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-i")) { // inode cache memory in KiB (0: no cache)
+            fs_set_icache(atoi(argv[2]) * 1024);
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-e")) { // block cache eviction policy
+            if (!strcmp(argv[2], "lru"))
+                cache_policy = BCACHE_LRU;
+            else if (!strcmp(argv[2], "clock"))
+                cache_policy = BCACHE_CLOCK;
+            else if (!strcmp(argv[2], "2q"))
+                cache_policy = BCACHE_2Q;
+            else {
+                printf("unknown cache policy: %s (use lru, clock or 2q)\n", argv[2]);
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-u")) { // stripe unit (stripe backend)
+            disk_stripe_unit(atoi(argv[2]));
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-t")) { // record an I/O trace
+            tracefile = argv[2];
+            argv += 2;
+            argc -= 2;
+        } else if (!strcmp(argv[1], "-p")) { // punch holes for freed blocks
+            disk_set_discard(1);
+            argv++;
+            argc--;
+        } else if (!strcmp(argv[1], "-s")) { // simulate a hard disk's timing
+            disk_set_model(&hdd);
+            simulate = 1;
+            argv++;
+            argc--;
+        } else
+            break;
+    }
     if (argc != 3 && argc != 2) {
-        printf("use: %s diskfile          to use an existing disk\n", argv[0]);
-        //printf("use: %s diskfile nblocks  to create a new disk with nblocks\n", argv[0]);
+        printf("use: %s [-b backend] [-c cache_blocks] [-e lru|clock|2q] [-f flush_ms] [-i icache_KiB] [-u stripe_unit] [-p] [-s] [-t tracefile] diskfile          to use an existing disk\n", prog);
+        printf("use: %s [options] diskfile nblocks  to create a new disk with nblocks (then format it)\n", prog);
+        printf("note: changes are kept in the cache and written within flush_ms (default %d;\n"
+               "      -f 0: only on sync, umount or quit, so a crash loses them all);\n"
+               "      with -c 0 every change is written at once\n", FLUSH_MS);
         return 1;
     }
     if (argc == 3)
@@ -54,8 +161,21 @@ int main(int argc, char *argv[]) {
     else
         nblocks = -1;
 
+    if (bcache_init(cache_blocks, cache_policy) < 0) {
+        printf("unable to allocate a cache of %d blocks\n", cache_blocks);
+        return 1;
+    }
+    // the flusher also writes when half the cache is dirty
+    fs_set_flusher(flush_age, cache_blocks > 1 ? cache_blocks / 2 : 1);
     if (fs_mount(argv[1], nblocks) < 0) {
-        printf("unable to initialize %s: %s\n", argv[1], strerror(errno));
+        if (disk_size() == 0) {
+            printf("unable to initialize %s: %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+        printf("use format to make a file system on %s\n", argv[1]);
+    }
+    if (tracefile != NULL && disk_trace_start(tracefile) < 0) {
+        printf("unable to create trace %s: %s\n", tracefile, strerror(errno));
         return 1;
     }
 
@@ -67,6 +187,7 @@ int main(int argc, char *argv[]) {
         args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
         if (args <= 0)
             continue;
+        struct disk_stats before = disk_stats();
 
         if (!strcmp(cmd, "debug")) {
             if (args == 1) {
@@ -74,6 +195,26 @@ int main(int argc, char *argv[]) {
             } else {
                 printf("use: debug\n");
             }
+        } else if (!strcmp(cmd, "df")) {
+            struct fs_df df;
+            if (args != 1)
+                printf("use: df\n");
+            else if (fs_df(&df) < 0)
+                printf("df failed\n");
+            else {
+                printf("%-8s %8s %8s %8s %5s\n", "", "total", "used", "free", "use%");
+                printf("%-8s %8d %8d %8d %4d%%\n", "blocks", df.blocks, df.blocks - df.free_blocks,
+                       df.free_blocks, 100 * (df.blocks - df.free_blocks) / df.blocks);
+                printf("%-8s %8d %8d %8d %4d%%\n", "inodes", df.inodes, df.inodes - df.free_inodes,
+                       df.free_inodes, 100 * (df.inodes - df.free_inodes) / df.inodes);
+            }
+        } else if (!strcmp(cmd, "format")) {
+            if (args <= 2) {
+                fs_set_groups(args == 2 ? atoi(arg1) : 0);
+                if (fs_format() < 0)
+                    printf("format failed\n");
+            } else
+                printf("use: format [group_blocks]\n");
         } else if (!strcmp(cmd, "ls")) {
             if (args == 1) {
                 if (fs_ls("/")<0)
@@ -120,6 +261,27 @@ int main(int argc, char *argv[]) {
                     printf("link failed!\n");
             } else
                 printf("use: ln <filename> <newname>\n");
+        } else if (!strcmp(cmd, "stats")) {
+            if (args == 1)
+                print_stats();
+            else if (args == 2 && !strcmp(arg1, "reset")) {
+                disk_stats_reset();
+                fs_cache_stats(NULL, 1);
+            }
+            else
+                printf("use: stats [reset]\n");
+        } else if (!strcmp(cmd, "sync")) {
+            if (args == 1) {
+                if (fs_sync() < 0)
+                    printf("sync failed\n");
+            } else
+                printf("use: sync\n");
+        } else if (!strcmp(cmd, "umount")) {
+            if (args == 1) {
+                if (fs_unmount() < 0)
+                    printf("umount failed\n");
+            } else
+                printf("use: umount\n");
         } else if (!strcmp(cmd, "help") || !strcmp(cmd, "?")) {
             print_help();
         } else if (!strcmp(cmd, "quit") || !strcmp(cmd, "exit") || !strcmp(cmd, "q")) {
@@ -128,10 +290,17 @@ int main(int argc, char *argv[]) {
             printf("unknown command: %s\n", cmd);
             printf("type 'help' or '?' for a list of commands.\n");
         }
+        if (simulate) {
+            struct disk_stats after = disk_stats();
+            if (after.vtime_us >= before.vtime_us) // else stats were reset
+                printf("simulated disk time: %.1f ms (%lu seeks)\n",
+                       (after.vtime_us - before.vtime_us) / 1000, after.seeks - before.seeks);
+        }
     }
 
     printf("closing emulated disk.\n");
-    disk_close();
+    fs_unmount(); // if still mounted
+    bcache_close();
 
     return EXIT_SUCCESS;
 }